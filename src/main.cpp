@@ -1,58 +1,610 @@
+#include <algorithm>
 #include <cerrno>
 #include <csignal>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <exception>
+#include <fcntl.h>
 #include <filesystem>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <ostream>
+#include <regex>
+#include <set>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <sys/file.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/poll.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 using namespace std;
 
+// Backing memory for line storage. Requests of 2 MB or more are mapped
+// directly and advised onto transparent huge pages. Block-sized requests
+// (4 KB to 64 KB) from buffers in huge-page mode are carved from 2 MB
+// regions - explicitly reserved huge pages when the system has them - so
+// random access across a large buffer touches few TLB entries.
+class PageHeap {
+public:
+  static constexpr size_t huge_page_size = 2 << 20;
+
+  static PageHeap &instance();
+  void *allocate(size_t bytes, bool huge_pages);
+  void deallocate(void *ptr, size_t bytes);
+
+private:
+  static constexpr size_t min_class_size = 4 * 1024;
+  static constexpr size_t class_count = 5; // 4 KB .. 64 KB
+
+  mutex heap_lock;
+  vector<void *> free_lists[class_count];
+  unordered_set<uintptr_t> regions;
+  char *region_cursor = nullptr;
+  size_t region_left = 0;
+
+  static size_t size_class(size_t bytes);
+  static void *map_huge(size_t bytes, bool try_reserved);
+};
+
+// Allocator routing container storage through PageHeap. It follows the
+// owning buffer's huge-page flag; without one only the direct mapping of
+// 2 MB+ tables applies.
+template <typename T> struct PageAllocator {
+  using value_type = T;
+  using propagate_on_container_copy_assignment = true_type;
+  using propagate_on_container_move_assignment = true_type;
+  using propagate_on_container_swap = true_type;
+
+  const bool *huge_pages;
+
+  PageAllocator(const bool *huge = nullptr) : huge_pages(huge) {}
+  template <typename U>
+  PageAllocator(const PageAllocator<U> &other)
+      : huge_pages(other.huge_pages) {}
+
+  T *allocate(size_t count) {
+    return static_cast<T *>(PageHeap::instance().allocate(
+        count * sizeof(T), huge_pages && *huge_pages));
+  }
+  void deallocate(T *ptr, size_t count) {
+    PageHeap::instance().deallocate(ptr, count * sizeof(T));
+  }
+
+  template <typename U> bool operator==(const PageAllocator<U> &other) const {
+    return huge_pages == other.huge_pages;
+  }
+  template <typename U> bool operator!=(const PageAllocator<U> &other) const {
+    return huge_pages != other.huge_pages;
+  }
+};
+
+// Append-only storage for line payloads too long to be kept inline. Space
+// left behind by edited lines is reclaimed when the block is compacted.
+// Blocks grow geometrically so small line blocks do not pin 64 KB each.
+class LineArena {
+private:
+  static constexpr size_t min_block_size = 4 * 1024;
+  static constexpr size_t max_block_size = 64 * 1024;
+  struct Chunk {
+    char *data;
+    size_t size;
+  };
+  vector<Chunk> blocks;
+  char *current_block;
+  size_t current_used;
+  size_t current_size;
+  size_t reserved;
+  const bool *huge_pages;
+
+public:
+  LineArena(const bool *huge = nullptr)
+      : current_block(nullptr), current_used(0), current_size(0),
+        reserved(0), huge_pages(huge) {}
+  LineArena(const LineArena &) = delete;
+  LineArena &operator=(const LineArena &) = delete;
+  ~LineArena() { release(); }
+
+  const char *store(string_view text);
+  size_t bytes() const { return reserved; }
+  void release();
+  void swap(LineArena &other);
+};
+
+// A line in 16 bytes. Up to 15 bytes are stored inline; longer payloads live
+// in the owning block's arena and the line keeps a pointer and a 56-bit
+// length. The last byte holds the inline length or the long-line tag.
+class Line {
+private:
+  static constexpr unsigned char long_tag = 0x80;
+  static constexpr unsigned char shared_tag = 0xc0; // Long, interned payload
+  char raw[16];
+
+  unsigned char tag() const { return static_cast<unsigned char>(raw[15]); }
+  void point_to(const char *data, size_t length, unsigned char line_tag);
+
+public:
+  static constexpr size_t inline_capacity = 15;
+
+  Line() { raw[15] = 0; }
+  Line(string_view text, LineArena &arena);
+  static Line shared(string_view interned);
+
+  bool is_inline() const { return !(tag() & long_tag); }
+  bool is_shared() const { return tag() == shared_tag; }
+  size_t size() const;
+  string_view view() const;
+};
+
+static_assert(sizeof(Line) == 16, "Line must stay 16 bytes");
+
+// Optional buffer-wide store for long lines: each distinct payload is kept
+// once and reference counted. Edits always build a new line, so a shared
+// payload is never written through - copy-on-write comes for free. Clones of
+// a buffer keep sharing its table.
+class InternTable {
+private:
+  bool huge_pages;
+  LineArena storage;
+  unordered_map<string_view, size_t> refs;
+  size_t distinct_bytes;   // Payload bytes stored once per distinct line
+  size_t referenced_bytes; // Payload bytes as seen by all lines
+  size_t line_refs;
+
+public:
+  bool enabled;
+
+  InternTable(bool enable = false)
+      : huge_pages(false), storage(&huge_pages), distinct_bytes(0),
+        referenced_bytes(0), line_refs(0), enabled(enable) {}
+  InternTable(const InternTable &) = delete;
+  InternTable &operator=(const InternTable &) = delete;
+
+  void use_huge_pages() { huge_pages = true; }
+
+  string_view acquire(string_view text);
+  void release(string_view interned);
+  void take_storage(LineArena &out);
+  bool is_fragmented() const;
+
+  size_t distinct_lines() const { return refs.size(); }
+  size_t shared_lines() const { return line_refs; }
+  double dedup_ratio() const;
+  size_t storage_bytes() const { return storage.bytes(); }
+};
+
+// A run of consecutive lines and the arena holding their long payloads.
+// Blocks are the unit of cold compression: an idle block can drop its lines
+// and keep only an LZ-packed copy until it is accessed again. They are also
+// the unit of sharing: cloned buffers point at the same blocks and copy one
+// only when they edit it.
+struct LineBlock {
+  static constexpr size_t max_lines = 2048;
+
+  bool huge_pages; // Fixed when the block is created
+  shared_ptr<InternTable> interned;
+  vector<Line, PageAllocator<Line>> lines;
+  LineArena arena;
+  size_t long_line_bytes; // Live payload bytes held in the arena
+  size_t count;           // Line count, valid even while packed
+  size_t text_bytes;      // Sum of line lengths, valid even while packed
+  string packed;          // Compressed copy of the lines, empty if none
+  size_t packed_raw_size;
+  bool resident;            // Whether the lines are materialized
+  unsigned long last_epoch; // Command epoch of the last access
+  unsigned long last_use;   // Access order among unpacked cold blocks
+
+  LineBlock(bool huge, shared_ptr<InternTable> intern_table)
+      : huge_pages(huge), interned(std::move(intern_table)),
+        lines(PageAllocator<Line>(&huge_pages)), arena(&huge_pages),
+        long_line_bytes(0), count(0), text_bytes(0), packed_raw_size(0),
+        resident(true),
+        last_epoch(0), last_use(0) {
+    if (huge_pages)
+      lines.reserve(max_lines); // Exactly one 32 KB heap class
+  }
+  LineBlock(const LineBlock &) = delete;
+  LineBlock &operator=(const LineBlock &) = delete;
+  ~LineBlock() { release_shared_lines(); }
+
+  Line make_line(string_view text);
+  void forget_line(const Line &line);
+  void release_shared_lines();
+  void pack();
+  void unpack();
+  void drop_lines();
+  void compact();
+  size_t storage_bytes() const;
+};
+
+// Hash index over one delimiter-separated column of a buffer's lines. Kept
+// current through edits: inserts and erases that shift line numbers are
+// logged rather than applied to every entry, and an entry's line is brought
+// up to date through the log when it is read. Past max_shifts, or after
+// wholesale replacements, it goes stale and is rebuilt on the next lookup.
+struct ColumnIndex {
+  static constexpr size_t max_shifts = 64;
+
+  struct Entry {
+    size_t line;   // Line index as of shifts[seen]
+    size_t seen;
+  };
+
+  size_t column; // 1-based
+  char delimiter;
+  bool stale;
+  unordered_multimap<size_t, Entry> lines; // Key hash -> line
+  // Each shift moves the lines from .first on by .second
+  vector<pair<size_t, ptrdiff_t>> shifts;
+
+  ColumnIndex(size_t col, char delim)
+      : column(col), delimiter(delim), stale(true) {}
+
+  size_t position(const Entry &entry) const {
+    size_t line = entry.line;
+    for (size_t i = entry.seen; i < shifts.size(); i++)
+      if (line >= shifts[i].first)
+        line += shifts[i].second;
+    return line;
+  }
+};
+
 struct Buffer {
   string name;
-  vector<string> lines;
   string file_path;
   bool is_modified;
 
-  Buffer(string buff_name) : name(buff_name), is_modified(false) {}
+  // Edits not yet written to the temp copy (shell mode defers persistence),
+  // and whether the pending write replaces the temp copy outright
+  bool dirty;
+  bool overwrite_pending;
+
+  // Version of the persisted copy the lines were loaded from, and a
+  // descriptor kept open on that copy so concurrent edits can be merged
+  // against it after another process has replaced the file.
+  unsigned long version;
+  int base_fd;
+  map<string, size_t> base_marks; // Marks as persisted in that version
+
+  // Bookkeeping for the memory-budgeted buffer cache
+  size_t memory_footprint;
+  unsigned long last_access;
+  unsigned long epoch; // Command epoch, used to tell cold blocks from hot ones
+
+  Buffer(string buff_name)
+      : name(buff_name), is_modified(false), dirty(false),
+        overwrite_pending(false), version(0), base_fd(-1),
+        memory_footprint(0), last_access(0), epoch(0), huge_pages(false),
+        interned(make_shared<InternTable>()), byte_tree_stale(true),
+        total_lines(0), text_bytes(0), use_clock(0) {}
+  ~Buffer() {
+    if (base_fd >= 0)
+      close(base_fd);
+  }
+
+  // Line storage. All edits go through these so the compact representation
+  // (and anything derived from it) stays consistent.
+  size_t line_count() const { return total_lines; }
+  size_t byte_count() const { return text_bytes + total_lines; }
+  string_view line(size_t index) const;
+  void set_line(size_t index, string_view text);
+  void insert_line(size_t index, string_view text);
+  void erase_line(size_t index);
+  void move_line(size_t from, size_t to);
+  void append_line(string_view text);
+  void clear_lines();
+  void compact();
+  void compress_cold_blocks(unsigned long idle_epochs);
+  size_t storage_bytes() const;
+  void share_lines(const Buffer &source);
+  void share_range(const Buffer &source, size_t first, size_t last);
+  void append_range(const Buffer &source, size_t first, size_t last);
+  void materialize() const;
+  void replace_lines(const vector<string_view> &new_lines,
+                     const vector<size_t> &origins);
+
+  void enable_interning() { interned->enabled = true; }
+  const InternTable &intern_table() const { return *interned; }
+
+  // Named marks on line indices. They follow their line as lines are
+  // inserted, erased or moved around them.
+  void set_mark(const string &mark, size_t index) { marks[mark] = index; }
+  bool remove_mark(const string &mark) { return marks.erase(mark) > 0; }
+  void clear_marks() { marks.clear(); }
+  const map<string, size_t> &mark_positions() const { return marks; }
+
+  // Byte addressing: offsets count every line plus its newline, from 0
+  size_t line_offset(size_t index) const;
+  size_t line_at_offset(size_t offset, size_t &column) const;
+
+  // Line-length aggregates, maintained on every edit
+  const map<size_t, size_t> &length_counts() const { return line_lengths; }
+  size_t longest_line() const {
+    return line_lengths.empty() ? 0 : line_lengths.rbegin()->first;
+  }
+
+  // Column index, see ColumnIndex
+  void create_index(size_t column, char delimiter);
+  void drop_index() { column_index.reset(); }
+  const ColumnIndex *index() const { return column_index.get(); }
+  vector<size_t> lookup(string_view key);
+  void resolve_index();
+  void restore_index(unordered_multimap<size_t, ColumnIndex::Entry> lines);
+
+private:
+  // Cold blocks that were unpacked for reading and still hold their packed
+  // copy. Bounded, so scans over compressed buffers stay within memory.
+  static constexpr size_t unpacked_cache_blocks = 8;
+
+  bool huge_pages; // Set once the buffer outgrows huge_page_threshold()
+  shared_ptr<InternTable> interned; // Table for lines added to this buffer
+  unique_ptr<ColumnIndex> column_index;
+  map<size_t, size_t> line_lengths; // Line length -> number of such lines
+  map<string, size_t> marks;
+
+  // Fenwick tree over the blocks' byte counts (lines plus newlines). Line
+  // edits update it in O(log blocks); adding or removing blocks marks it
+  // stale and it is rebuilt on the next offset query.
+  mutable vector<size_t> block_byte_tree;
+  mutable bool byte_tree_stale;
+
+  // Index tables; past 2 MB they are mapped onto huge pages. Blocks may be
+  // shared with other buffers and are copied before being edited.
+  vector<shared_ptr<LineBlock>, PageAllocator<shared_ptr<LineBlock>>> blocks;
+  vector<size_t, PageAllocator<size_t>> block_starts; // Each block's 1st line
+  size_t total_lines;
+  size_t text_bytes; // Sum of line lengths
+  mutable vector<LineBlock *> unpacked_blocks;
+  mutable unsigned long use_clock;
+
+  size_t locate(size_t index, size_t &offset) const;
+  LineBlock &readable_block(size_t block_index) const;
+  LineBlock &writable_block(size_t block_index);
+  void forget_unpacked(LineBlock *block) const;
+  void shift_block_starts(size_t after_block, ptrdiff_t delta);
+  void split_block(size_t block_index);
+  shared_ptr<LineBlock> new_block();
+  size_t index_key_hash(string_view line) const;
+  void index_line(size_t index, string_view line);
+  void unindex_line(size_t index, string_view line);
+  void shift_index(size_t from, ptrdiff_t delta);
+  void count_length(size_t length, ptrdiff_t delta);
+  void shift_marks(size_t index, ptrdiff_t delta);
+  void add_block_bytes(size_t block_index, ptrdiff_t delta);
+  void rebuild_byte_tree() const;
+  void invalidate_index() {
+    if (column_index)
+      column_index->stale = true;
+  }
+};
+
+// Pool of Buffer objects. Storage is carved from fixed-size slabs and
+// recycled through a free list, so creating and evicting buffers in a
+// long-lived process does not go back to the allocator each time.
+class BufferPool {
+private:
+  static constexpr size_t slab_capacity = 64;
+  vector<void *> slabs;
+  vector<void *> free_slots;
+
+public:
+  BufferPool() = default;
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+  ~BufferPool();
+
+  Buffer *acquire(string_view name);
+  void release(Buffer *buf);
+};
+
+// Open-addressing (linear probing) hash map from buffer name to Buffer.
+// Keys are the buffers' own names, so lookups by string_view never copy or
+// allocate.
+class BufferRegistry {
+private:
+  enum SlotState : unsigned char { EMPTY, OCCUPIED, DELETED };
+  struct Slot {
+    size_t hash;
+    Buffer *buffer;
+    SlotState state;
+  };
+
+  vector<Slot> slots;
+  size_t occupied;
+  size_t deleted;
+
+  size_t probe(string_view name, size_t hash) const;
+  void rehash(size_t capacity);
+
+public:
+  BufferRegistry()
+      : slots(16, Slot{0, nullptr, EMPTY}), occupied(0), deleted(0) {}
+
+  Buffer *find(string_view name) const;
+  void insert(Buffer *buf);
+  bool erase(string_view name);
+  size_t size() const { return occupied; }
+
+  template <typename Fn> void for_each(Fn fn) const {
+    for (const Slot &slot : slots)
+      if (slot.state == OCCUPIED)
+        fn(slot.buffer);
+  }
+};
+
+struct SortOptions {
+  bool numeric = false;
+  bool reverse = false;
+  size_t key_field = 0; // 1-based; 0 sorts on the whole line
+  char delimiter = 0;   // 0 splits fields on runs of blanks
+};
+
+struct CutOptions {
+  char delimiter = '\t';
+  vector<bool> fields;  // fields[N] is set if field N (1-based) is selected
+  size_t open_from = 0; // Selects every field from this one on, if nonzero
+
+  bool selects(size_t field) const {
+    return (field < fields.size() && fields[field]) ||
+           (open_from && field >= open_from);
+  }
+};
+
+struct FindOptions {
+  bool backward = false;
+  bool wrap = false;
+  size_t nth = 1; // Which hit to stop at
+};
+
+// One edit of an edit script, addressed in the coordinates of the buffer
+// before any of the script's edits
+struct LineEdit {
+  enum Kind { INSERT_BEFORE, REPLACE_LINE, DELETE_LINE };
+
+  Kind kind;
+  size_t line; // 0-based; line_count() to insert at the end
+  string text;
+};
+
+// Hunk of a unified diff. Lines keep their ' ', '-' or '+' prefix.
+struct DiffHunk {
+  size_t old_start; // 0-based line the old side starts at
+  vector<string> lines;
+  size_t leading_context;  // Context lines before the first change
+  size_t trailing_context; // Context lines after the last change
 };
 
 class BufferManager {
 private:
-  map<string, Buffer *> buffers;
+  BufferRegistry buffers;
+  BufferPool buffer_pool;
   Buffer *current_buffer;
   string temp_directory;
 
+  // Memory budget (0 = unlimited) and LRU cache counters
+  size_t memory_budget;
+  unsigned long access_clock;
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+  unsigned long cache_evictions;
+
+  // Cold block compression (0 = disabled): blocks idle for this many
+  // commands are packed in memory
+  unsigned long compress_after_commands;
+  unsigned long command_epoch;
+
+  bool intern_lines; // Deduplicate identical long lines in new buffers
+
+  // Shell mode: edits only mark buffers dirty until sync or eviction
+  bool defer_persistence;
+
+  // Undo log of the open transaction: a copy-on-write snapshot of every
+  // buffer it touched, taken when first touched. Buffers that were not
+  // resident then map to null; nothing is persisted before the commit, so
+  // dropping them restores them.
+  bool in_transaction;
+  unordered_map<string, Buffer *> undo_log;
+
+  void touch_buffer(Buffer *buf);
+  void log_undo(Buffer *buf, bool resident);
+  void restore_undo_log();
+  bool stage_temp_copy(Buffer *buf);
+  bool external_sort_buffer(const string &name, const SortOptions &options);
+  bool print_persisted_stats(const string &name);
+  void write_marks(Buffer *buf);
+  void commit_marks(Buffer *buf);
+  void write_stats(Buffer *buf);
+  void write_index_entries(Buffer *buf);
+  bool read_index_entries(Buffer *buf);
+  void write_marks(const string &name, const map<string, size_t> &marks);
+  map<string, size_t> read_marks(const string &name);
+  bool persist_marks(Buffer *buf);
+  void set_current_line(Buffer *buf, int line_num);
+  int write_split_parts(Buffer *source, const vector<size_t> &part_starts);
+  void remove_buffer(const string &name);
+  bool apply_line_edits(Buffer *buf, vector<LineEdit> &edits);
+
 public:
   BufferManager();
   ~BufferManager();
 
   // Buffer management
-  Buffer *create_buffer(string name);
-  Buffer *get_buffer(string name);
-  bool select_buffer(string name);
-  void save_buffer_to_temp(Buffer *buf);
-  void load_buffer_from_temp(string name);
+  Buffer *create_buffer(string_view name);
+  Buffer *get_buffer(string_view name);
+  bool select_buffer(string_view name);
+  bool save_buffer_to_temp(Buffer *buf, bool overwrite = false);
+  bool flush_buffer(Buffer *buf);
+  bool sync_buffers();
+  void set_deferred_persistence(bool defer) { defer_persistence = defer; }
+
+  // Transactions (deferred persistence only)
+  bool transaction_open() const { return in_transaction; }
+  bool begin_transaction();
+  bool commit_transaction();
+  void abort_transaction();
+  void load_buffer_from_temp(string_view name);
+
+  // Concurrency control
+  int lock_buffer(const string &name, int operation);
+  unsigned long read_persisted_version(const string &name);
+  bool merge_concurrent_edits(Buffer *buf);
+  void commit_persisted_metadata(Buffer *buf, unsigned long version);
+
+  // Cache management
+  void compress_cold_blocks();
+  void enforce_memory_budget();
+  void print_cache_stats();
 
   // Buffer operations
   bool open_file(string buffer_name, string file_path);
   bool save_file(string buffer_name, string file_path = "");
   bool create_new_buffer(string buffer_name, string file_path = "");
+  bool clone_buffer(string buffer_name, string source_name);
+  bool concat_buffers(const vector<string> &source_names, string target_name);
+  int split_buffer_every(string buffer_name, size_t lines_per_part);
+  int split_buffer_at(string buffer_name, string pattern);
+  bool sort_buffer(string buffer_name, const SortOptions &options);
+  int uniq_buffer(string buffer_name);
+  int filter_buffer(string buffer_name, bool keep, string term,
+                    bool use_regex);
+  bool cut_buffer(string buffer_name, const CutOptions &options,
+                  string target_name = "");
+  int apply_edit_script(string buffer_name, string script_path);
+  int patch_buffer(string buffer_name, string diff_path);
+  bool create_index(string buffer_name, size_t column, char delimiter);
+  bool drop_index(string buffer_name);
+  void lookup_in_buffer(string buffer_name, string key);
   void print_buffer(string buffer_name);
-  void append_to_buffer(string buffer_name, string content);
+  bool append_to_buffer(string buffer_name, string content);
   void find_in_buffer(string buffer_name, string term);
+  bool find_next_in_buffer(string buffer_name, string term, int from_line,
+                           const FindOptions &options);
   void where_in_buffer(string buffer_name, string term);
   int replace_in_buffer(string buffer_name, string term, string replacement);
   void watch_buffer(string buffer_name);
+  void print_stats(string buffer_name);
+  void print_word_stats(string buffer_name, size_t top_count);
+  bool print_at_byte(string buffer_name, size_t offset, string mode);
+
+  // Marks and line addresses
+  bool set_mark(string buffer_name, string mark, int line_num);
+  bool delete_mark(string buffer_name, string mark);
+  void list_marks(string buffer_name);
+  bool resolve_address(string buffer_name, const string &address,
+                       int &line_num);
+  void set_current_line(string buffer_name, int line_num);
 
   // Line operations
   bool replace_line(string buffer_name, int line_num, string content);
@@ -60,9 +612,12 @@ public:
   bool delete_line(string buffer_name, int line_num);
   bool move_line(string buffer_name, int from_line_num, int to_line_num);
   bool copy_line(string buffer_name, int line_num, int to_line_num);
+  bool extract_lines(string buffer_name, int start_line, int end_line,
+                     string target_name);
   string get_line(string buffer_name, int line_num);
   void print_line(string buffer_name, int line_num);
   void print_lines(string buffer_name, int start_line, int end_line);
+  bool print_line_offset(string buffer_name, int line_num);
 };
 
 enum CommandType { BUFFER_CMD, LINE_CMD };
@@ -76,7 +631,28 @@ enum BufferCommand {
   FIND,
   WHERE,
   WATCH,
-  FIND_REPLACE
+  FIND_REPLACE,
+  CACHE_STATS,
+  STATS,
+  CLONE,
+  FIND_NEXT,
+  CONCAT,
+  SPLIT,
+  SORT,
+  UNIQ,
+  FILTER,
+  CUT,
+  INDEX_CREATE,
+  INDEX_DROP,
+  LOOKUP,
+  AT_BYTE,
+  MARK_SET,
+  MARK_DELETE,
+  MARK_LIST,
+  SHELL,
+  BATCH,
+  APPLY,
+  PATCH
 };
 
 enum LineCommand {
@@ -87,7 +663,9 @@ enum LineCommand {
   COPY,
   GET,
   PRINT_LINE,
-  PRINT_RANGE
+  PRINT_RANGE,
+  EXTRACT,
+  OFFSET
 };
 
 struct ParsedCommand {
@@ -98,12 +676,23 @@ struct ParsedCommand {
   BufferCommand buffer_cmd;
   string buffer_arg;
   string replacement_arg;
+  vector<string> buffer_args; // For commands taking several buffers
+  SortOptions sort_options;
+  bool use_regex;
+  CutOptions cut_options;
+  FindOptions find_options;
+  size_t column; // Index column, stats top count or at-byte offset
 
   // For line commands
   LineCommand line_cmd;
   int line_number;
   int second_line_number; // For ranged operations
   string line_content;
+
+  // Symbolic forms of the line numbers above (e.g. "$-2", "@mark",
+  // "/pattern/"), resolved when the command runs
+  string line_address;
+  string second_address;
 };
 
 class CommandParser {
@@ -118,6 +707,11 @@ private:
   BufferManager *buffer_manager;
   CommandParser *parser;
 
+  bool resolve_addresses(ParsedCommand &cmd);
+  int run_script_line(const string &buffer_name, vector<string> words);
+  int run_shell(const string &buffer_name);
+  int run_batch(const string &buffer_name, const string &path);
+
 public:
   BFFEditor();
   ~BFFEditor();
@@ -126,6 +720,70 @@ public:
   void run(int argc, char **argv);
 };
 
+// Splits a shell input line into words. Single and double quotes group
+// words and a backslash escapes the next character.
+vector<string> split_command_line(const string &input) {
+  vector<string> words;
+  string word;
+  bool in_word = false;
+  char quote = 0;
+  for (size_t i = 0; i < input.size(); i++) {
+    char c = input[i];
+    if (c == '\\' && i + 1 < input.size() && quote != '\'') {
+      word += input[++i];
+      in_word = true;
+    } else if (quote) {
+      if (c == quote)
+        quote = 0;
+      else
+        word += c;
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+      in_word = true;
+    } else if (isspace(static_cast<unsigned char>(c))) {
+      if (in_word)
+        words.push_back(word);
+      word.clear();
+      in_word = false;
+    } else {
+      word += c;
+      in_word = true;
+    }
+  }
+  if (in_word)
+    words.push_back(word);
+  return words;
+}
+
+// Splits an address range "A,B" at the first comma outside a pattern
+bool split_address_range(const string &arg, string &first, string &second) {
+  char delimiter = 0;
+  for (size_t i = 0; i < arg.size(); i++) {
+    if (delimiter) {
+      if (arg[i] == delimiter)
+        delimiter = 0;
+    } else if (arg[i] == '/' || arg[i] == '?') {
+      delimiter = arg[i];
+    } else if (arg[i] == ',') {
+      first = arg.substr(0, i);
+      second = arg.substr(i + 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+// A line argument is either a line number or a symbolic address
+void parse_line_address(const string &arg, int &line_number,
+                        string &address) {
+  if (!arg.empty() && all_of(arg.begin(), arg.end(), ::isdigit)) {
+    line_number = stoi(arg);
+  } else {
+    line_number = 0;
+    address = arg;
+  }
+}
+
 string padder(int total_length, size_t length_of_variable_to_pad_before,
               char char_to_represent_paddign = '0') {
   int number_of_chars_to_pad = total_length - length_of_variable_to_pad_before;
@@ -137,9 +795,9 @@ string padder(int total_length, size_t length_of_variable_to_pad_before,
   return result;
 }
 
-string highlight_term(const string &line, const string &term) {
+string highlight_term(string_view line, string_view term) {
   if (term.empty())
-    return line;
+    return string(line);
 
   const string highlight_start = "\033[1;31m";
   const string highlight_end = "\033[0m";
@@ -160,202 +818,3186 @@ string highlight_term(const string &line, const string &term) {
   return result;
 }
 
-volatile sig_atomic_t watch_should_stop = 0;
-void handle_watch_interrupt(int) { watch_should_stop = 1; }
-
-///////////////////////////////////////////////////////
-///////////////////////////////////////////////////////
-
-BufferManager::BufferManager() {
-  current_buffer = nullptr;
-  temp_directory = "/tmp/bff_buffers/";
-
-  if (!filesystem::exists(temp_directory))
-    filesystem::create_directories(temp_directory);
-}
-
-BufferManager::~BufferManager() {
-  for (auto &pair : buffers) {
-    save_buffer_to_temp(pair.second);
-    delete pair.second;
+vector<string> read_lines_from_fd(int fd) {
+  vector<string> lines;
+  if (fd < 0 || lseek(fd, 0, SEEK_SET) < 0)
+    return lines;
+
+  string pending;
+  char chunk[65536];
+  ssize_t len;
+  while ((len = read(fd, chunk, sizeof(chunk))) > 0) {
+    for (ssize_t i = 0; i < len; i++) {
+      if (chunk[i] == '\n') {
+        lines.push_back(pending);
+        pending.clear();
+      } else {
+        pending += chunk[i];
+      }
+    }
   }
-}
-
-Buffer *BufferManager::create_buffer(string name) {
-  if (buffers.find(name) != buffers.end())
-    return buffers[name]; // Buffer already exists
+  if (!pending.empty())
+    lines.push_back(pending);
 
-  Buffer *new_buffer = new Buffer(name);
-  buffers[name] = new_buffer;
-  return new_buffer;
+  return lines;
 }
 
-Buffer *BufferManager::get_buffer(string name) {
-  auto it = buffers.find(name);
-  if (it != buffers.end())
-    return it->second;
+// Byte-oriented LZ77 codec in the LZ4 style, used for cold line blocks.
+// Each sequence is a token (literal length << 4 | match length - 4), the
+// literals, and a 16-bit match offset; nibbles of 15 continue in extra bytes.
+// The final sequence carries literals only.
+static void lz_put_length(string &out, size_t length) {
+  for (; length >= 255; length -= 255)
+    out += static_cast<char>(255);
+  out += static_cast<char>(length);
+}
 
-  load_buffer_from_temp(name);
-  it = buffers.find(name);
-  if (it != buffers.end())
-    return it->second;
+string lz_compress(string_view input) {
+  constexpr size_t min_match = 4;
+  constexpr size_t max_offset = 65535;
+  constexpr int hash_bits = 14;
+
+  string out;
+  out.reserve(input.size() / 2 + 16);
+  vector<uint32_t> table(size_t(1) << hash_bits, 0); // position + 1
+
+  auto read32 = [&input](size_t pos) {
+    uint32_t value;
+    memcpy(&value, input.data() + pos, sizeof(value));
+    return value;
+  };
+  auto emit = [&out, &input](size_t anchor, size_t literals, size_t offset,
+                             size_t match_length) {
+    size_t match_code = match_length ? match_length - min_match : 0;
+    out += static_cast<char>((min(literals, size_t(15)) << 4) |
+                             min(match_code, size_t(15)));
+    if (literals >= 15)
+      lz_put_length(out, literals - 15);
+    out.append(input.data() + anchor, literals);
+    if (!match_length)
+      return;
+    out += static_cast<char>(offset & 0xff);
+    out += static_cast<char>(offset >> 8);
+    if (match_code >= 15)
+      lz_put_length(out, match_code - 15);
+  };
 
-  return create_buffer(name);
-}
+  size_t anchor = 0;
+  size_t pos = 0;
+  while (pos + min_match <= input.size()) {
+    uint32_t sequence = read32(pos);
+    uint32_t slot = (sequence * 2654435761u) >> (32 - hash_bits);
+    size_t candidate = table[slot];
+    table[slot] = static_cast<uint32_t>(pos + 1);
+
+    if (candidate == 0 || pos - (candidate - 1) > max_offset ||
+        read32(candidate - 1) != sequence) {
+      pos++;
+      continue;
+    }
 
-bool BufferManager::select_buffer(string name) {
-  auto it = buffers.find(name);
-  if (it != buffers.end()) {
-    current_buffer = it->second;
-    return true;
-  }
+    size_t match_start = candidate - 1;
+    size_t length = min_match;
+    while (pos + length < input.size() &&
+           input[match_start + length] == input[pos + length])
+      length++;
 
-  load_buffer_from_temp(name);
-  it = buffers.find(name);
-  if (it != buffers.end()) {
-    current_buffer = it->second;
-    return true;
+    emit(anchor, pos - anchor, pos - match_start, length);
+    pos += length;
+    anchor = pos;
   }
 
-  return false;
+  emit(anchor, input.size() - anchor, 0, 0);
+  return out;
 }
 
-void BufferManager::save_buffer_to_temp(Buffer *buf) {
-  if (!buf)
-    return;
+string lz_decompress(string_view input, size_t raw_size) {
+  string out;
+  out.reserve(raw_size);
 
-  string temp_file_path = temp_directory + buf->name + ".tmp";
-  ofstream temp_file(temp_file_path);
+  size_t pos = 0;
+  auto get_length = [&input, &pos](size_t length) {
+    if (length < 15)
+      return length;
+    unsigned char byte;
+    do {
+      byte = static_cast<unsigned char>(input[pos++]);
+      length += byte;
+    } while (byte == 255);
+    return length;
+  };
+
+  while (pos < input.size()) {
+    unsigned char token = static_cast<unsigned char>(input[pos++]);
+    size_t literals = get_length(token >> 4);
+    out.append(input.data() + pos, literals);
+    pos += literals;
+    if (pos >= input.size())
+      break;
 
-  if (temp_file.is_open()) {
-    for (const auto &line : buf->lines)
-      temp_file << line << "\n";
+    size_t offset = static_cast<unsigned char>(input[pos]) |
+                    (static_cast<unsigned char>(input[pos + 1]) << 8);
+    pos += 2;
+    size_t length = get_length(token & 0x0f) + 4;
 
-    temp_file.close();
+    // Matches may overlap their own output, so copy byte by byte
+    size_t from = out.size() - offset;
+    for (size_t i = 0; i < length; i++)
+      out += out[from + i];
   }
 
-  string meta_file_path = temp_directory + buf->name + ".path";
-  ofstream meta_file(meta_file_path);
-  if (meta_file.is_open()) {
-    meta_file << buf->file_path;
-    meta_file.close();
+  return out;
+}
+
+// Parses sizes such as "512M" or "64G" (binary multiples) into bytes
+size_t parse_byte_size(const string &text) {
+  size_t pos = 0;
+  unsigned long long value = stoull(text, &pos);
+  if (pos < text.size()) {
+    switch (toupper(text[pos])) {
+    case 'K':
+      value <<= 10;
+      break;
+    case 'M':
+      value <<= 20;
+      break;
+    case 'G':
+      value <<= 30;
+      break;
+    case 'T':
+      value <<= 40;
+      break;
+    default:
+      throw invalid_argument("Invalid size: " + text);
+    }
   }
+  return value;
 }
 
-void BufferManager::load_buffer_from_temp(string name) {
-  string temp_file_path = temp_directory + name + ".tmp";
-  if (!filesystem::exists(temp_file_path))
-    return;
+// Buffers whose lines take more than this move to huge-page backed storage
+size_t huge_page_threshold() {
+  static const size_t threshold = [] {
+    const char *configured = getenv("BFF_HUGEPAGE_THRESHOLD");
+    return configured ? parse_byte_size(configured) : size_t(256) << 20;
+  }();
+  return threshold;
+}
 
-  Buffer *buf = create_buffer(name);
-  buf->lines.clear();
+size_t buffer_footprint(const Buffer *buf) {
+  return sizeof(Buffer) + buf->storage_bytes();
+}
 
-  ifstream temp_file(temp_file_path);
-  if (temp_file.is_open()) {
-    string line;
-    while (getline(temp_file, line)) {
-      buf->lines.push_back(line);
+// Returns the line from the start of its key_field-th field, as sort -k does
+string_view sort_key(string_view line, const SortOptions &options) {
+  if (options.key_field == 0)
+    return line;
+
+  size_t pos = 0;
+  for (size_t field = 1; field < options.key_field; field++) {
+    if (options.delimiter) {
+      pos = line.find(options.delimiter, pos);
+      if (pos == string_view::npos)
+        return string_view();
+      pos++;
+    } else {
+      pos = line.find_first_not_of(" \t", pos);
+      pos = line.find_first_of(" \t", pos);
+      if (pos == string_view::npos)
+        return string_view();
     }
-    temp_file.close();
   }
+  if (!options.delimiter)
+    pos = min(line.find_first_not_of(" \t", pos), line.size());
+  return line.substr(pos);
+}
 
-  string meta_file_path = temp_directory + name + ".path";
-  if (filesystem::exists(meta_file_path)) {
-    ifstream meta_file(meta_file_path);
-    if (meta_file.is_open()) {
-      getline(meta_file, buf->file_path);
-      meta_file.close();
-    }
+// Substring search: memchr (vectorized in libc) skips to candidate first
+// bytes, and only those are compared in full
+size_t find_term(string_view text, string_view term, size_t from = 0) {
+  if (term.empty())
+    return from <= text.size() ? from : string_view::npos;
+  if (term.size() > text.size())
+    return string_view::npos;
+
+  const char *end = text.data() + text.size();
+  const char *last_start = end - term.size();
+  for (const char *p = text.data() + from; p <= last_start; p++) {
+    p = static_cast<const char *>(memchr(p, term[0], last_start - p + 1));
+    if (!p)
+      break;
+    if (memcmp(p + 1, term.data() + 1, term.size() - 1) == 0)
+      return p - text.data();
   }
+  return string_view::npos;
 }
 
-bool BufferManager::open_file(string buffer_name, string file_path) {
-  Buffer *buf = create_buffer(buffer_name);
+// Parses a cut(1) style list such as "1,3-5,7-"
+void parse_field_list(const string &list, CutOptions &options) {
+  size_t pos = 0;
+  while (pos <= list.size()) {
+    size_t end = min(list.find(',', pos), list.size());
+    string item = list.substr(pos, end - pos);
+    size_t dash = item.find('-');
+    size_t first = stoul(dash == 0 ? "1" : item.substr(0, dash));
+    if (first == 0)
+      throw invalid_argument("Fields are numbered from 1");
+
+    if (dash == string::npos || dash + 1 < item.size()) {
+      size_t last =
+          dash == string::npos ? first : stoul(item.substr(dash + 1));
+      if (last >= options.fields.size())
+        options.fields.resize(last + 1);
+      for (size_t field = first; field <= last; field++)
+        options.fields[field] = true;
+    } else if (!options.open_from || first < options.open_from) {
+      options.open_from = first;
+    }
+    pos = end + 1;
+  }
+}
 
-  ifstream file(file_path);
-  if (!file.is_open())
+// Reads the hunks of a unified diff against a single file. File headers and
+// other lines between hunks are skipped.
+bool read_unified_diff(const string &path, vector<DiffHunk> &hunks) {
+  ifstream diff(path);
+  if (!diff.is_open()) {
+    cerr << "Error: could not open patch " << path << endl;
     return false;
+  }
 
-  buf->lines.clear();
-  buf->file_path = file_path;
+  static const regex hunk_header(R"(^@@ -(\d+)(?:,(\d+))? )"
+                                 R"(\+(\d+)(?:,(\d+))? @@)");
+  string input;
+  size_t diff_line = 0;
+  bool seen_file = false;
+  while (getline(diff, input)) {
+    diff_line++;
+    if (input.rfind("--- ", 0) == 0) {
+      if (seen_file && !hunks.empty()) {
+        cerr << "Error: " << path << ":" << diff_line
+             << ": patch changes more than one file" << endl;
+        return false;
+      }
+      seen_file = true;
+      continue;
+    }
+    smatch match;
+    if (!regex_search(input, match, hunk_header))
+      continue;
 
-  string line;
-  while (getline(file, line))
-    buf->lines.push_back(line);
+    DiffHunk hunk;
+    size_t old_start = stoul(match[1]);
+    size_t old_count = match[2].matched ? stoul(match[2]) : 1;
+    size_t new_count = match[4].matched ? stoul(match[4]) : 1;
+    // An empty old side names the line it follows
+    hunk.old_start = old_count == 0 || old_start == 0 ? old_start
+                                                      : old_start - 1;
+    while (old_count > 0 || new_count > 0) {
+      if (!getline(diff, input)) {
+        cerr << "Error: " << path << ": truncated hunk" << endl;
+        return false;
+      }
+      diff_line++;
+      if (input.empty())
+        input = " "; // Blank context line whose space was stripped
+      if (input[0] == '\\')
+        continue; // "\ No newline at end of file"
+
+      if (input[0] == ' ' && old_count > 0 && new_count > 0) {
+        old_count--;
+        new_count--;
+      } else if (input[0] == '-' && old_count > 0) {
+        old_count--;
+      } else if (input[0] == '+' && new_count > 0) {
+        new_count--;
+      } else {
+        cerr << "Error: " << path << ":" << diff_line << ": malformed hunk"
+             << endl;
+        return false;
+      }
+      hunk.lines.push_back(std::move(input));
+    }
 
-  file.close();
-  buf->is_modified = false;
-  save_buffer_to_temp(buf);
+    const vector<string> &lines = hunk.lines;
+    hunk.leading_context = 0;
+    while (hunk.leading_context < lines.size() &&
+           lines[hunk.leading_context][0] == ' ')
+      hunk.leading_context++;
+    hunk.trailing_context = 0;
+    while (hunk.trailing_context < lines.size() - hunk.leading_context &&
+           lines[lines.size() - 1 - hunk.trailing_context][0] == ' ')
+      hunk.trailing_context++;
+    hunks.push_back(std::move(hunk));
+  }
+
+  if (hunks.empty()) {
+    cerr << "Error: no hunks found in " << path << endl;
+    return false;
+  }
   return true;
 }
 
-bool BufferManager::save_file(string buffer_name, string file_path) {
-  Buffer *buf = get_buffer(buffer_name);
-  if (!buf)
-    return false;
+// Returns the column-th (1-based) delimiter-separated field of line, or an
+// empty view if the line has fewer fields
+string_view field_view(string_view line, size_t column, char delimiter) {
+  const char *p = line.data();
+  const char *end = p + line.size();
+  for (size_t field = 1; field < column; field++) {
+    p = static_cast<const char *>(memchr(p, delimiter, end - p));
+    if (!p)
+      return string_view();
+    p++;
+  }
+  const char *next = static_cast<const char *>(memchr(p, delimiter, end - p));
+  return string_view(p, (next ? next : end) - p);
+}
 
-  string save_path = file_path.empty() ? buf->file_path : file_path;
-  if (save_path.empty())
-    return false;
+// Appends the selected fields of line to out, joined by the delimiter. The
+// delimiters are found with memchr; a line without any is kept whole.
+void cut_fields(string_view line, const CutOptions &options, string &out) {
+  const char *p = line.data();
+  const char *end = p + line.size();
+  if (!memchr(p, options.delimiter, line.size())) {
+    out += line;
+    return;
+  }
 
-  ofstream file(save_path);
-  if (!file.is_open())
-    return false;
+  bool first_out = true;
+  for (size_t field = 1; p <= end; field++) {
+    const char *next =
+        static_cast<const char *>(memchr(p, options.delimiter, end - p));
+    if (!next)
+      next = end;
+    if (options.selects(field)) {
+      if (!first_out)
+        out += options.delimiter;
+      out.append(p, next - p);
+      first_out = false;
+    }
+    if (!options.open_from && field + 1 >= options.fields.size())
+      break; // No later field is selected
+    p = next + 1;
+  }
+}
+
+void print_length_histogram(const map<size_t, size_t> &line_lengths) {
+  cout << "Longest:     "
+       << (line_lengths.empty() ? 0 : line_lengths.rbegin()->first) << endl;
+  cout << "Line lengths:" << endl;
+
+  // Power-of-two buckets: 0, 1, 2-3, 4-7, ...
+  auto it = line_lengths.begin();
+  while (it != line_lengths.end()) {
+    size_t low = it->first ? size_t(1) << (63 - __builtin_clzll(it->first)) : 0;
+    size_t high = low ? 2 * low - 1 : 0;
+    size_t count = 0;
+    for (; it != line_lengths.end() && it->first <= high; ++it)
+      count += it->second;
+
+    string range = to_string(low) + "-" + to_string(high);
+    cout << padder(16, range.length(), ' ') << range << ": " << count << endl;
+  }
+}
 
-  for (const auto line : buf->lines)
-    file << line << "\n";
+// Leading number of a key as sort -n reads it: blanks, an optional minus,
+// digits and an optional fraction. Anything else (hex, "inf", "nan") is 0,
+// so keys always compare as a strict weak order.
+double sort_number(string_view key) {
+  size_t pos = key.find_first_not_of(" \t");
+  if (pos == string_view::npos)
+    return 0;
+
+  size_t start = pos;
+  if (key[pos] == '-')
+    pos++;
+  size_t digits = pos;
+  while (pos < key.size() && isdigit(static_cast<unsigned char>(key[pos])))
+    pos++;
+  if (pos < key.size() && key[pos] == '.') {
+    pos++;
+    while (pos < key.size() && isdigit(static_cast<unsigned char>(key[pos])))
+      pos++;
+  }
+  if (pos == digits || (pos == digits + 1 && key[digits] == '.'))
+    return 0;
 
-  file.close();
-  buf->is_modified = false;
-  if (!file_path.empty())
-    buf->file_path = file_path;
-  save_buffer_to_temp(buf);
-  return true;
+  return strtod(string(key.substr(start, pos - start)).c_str(), nullptr);
 }
 
-bool BufferManager::create_new_buffer(string buffer_name, string file_path) {
-  Buffer *buf = create_buffer(buffer_name);
-  buf->lines.clear();
-  buf->file_path = file_path;
-  buf->is_modified = false;
-  save_buffer_to_temp(buf);
-  return true;
+// Orders two lines by their sort keys; the numbers are only used with -n
+bool sort_keys_less(string_view key_a, double number_a, string_view key_b,
+                    double number_b, const SortOptions &options) {
+  if (options.reverse) {
+    swap(key_a, key_b);
+    swap(number_a, number_b);
+  }
+  if (options.numeric)
+    return number_a < number_b;
+  return key_a < key_b;
 }
 
-void BufferManager::print_buffer(string buffer_name) {
-  Buffer *buf = get_buffer(buffer_name);
-  if (!buf) {
-    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+// Stable merge sort that hands halves of the range to separate threads
+// until each thread has a run of its own
+template <typename Less>
+void parallel_sort(size_t *first, size_t *last, const Less &less,
+                   unsigned threads) {
+  if (threads < 2 || last - first < 64 * 1024) {
+    stable_sort(first, last, less);
     return;
   }
 
-  for (size_t i = 0; i < buf->lines.size(); i++)
-    cout << padder(4, to_string(i + 1).length()) << i + 1 << ": "
-         << buf->lines[i] << endl;
+  size_t *middle = first + (last - first) / 2;
+  thread lower([&] { parallel_sort(first, middle, less, threads / 2); });
+  parallel_sort(middle, last, less, threads - threads / 2);
+  lower.join();
+  inplace_merge(first, middle, last, less);
 }
 
-void BufferManager::append_to_buffer(string buffer_name, string content) {
-  Buffer *buf = get_buffer(buffer_name);
-  if (!buf)
-    return;
+// Tournament tree over the heads of k sorted runs. Each inner node keeps the
+// loser of the match played there, so after the winner's run advances only
+// its path to the root is replayed: log2(k) comparisons per merged line.
+// less must be a strict total order over run indices.
+template <typename Less> class LoserTree {
+private:
+  vector<size_t> nodes; // nodes[0] is the winner, 1..k-1 the losers
+  size_t leaves;
+  Less less;
 
-  buf->lines.push_back(content);
-  buf->is_modified = true;
-  save_buffer_to_temp(buf);
-}
+public:
+  LoserTree(size_t run_count, Less run_less)
+      : nodes(max<size_t>(run_count, 1)), leaves(run_count), less(run_less) {
+    vector<size_t> winners(2 * leaves);
+    for (size_t i = 0; i < leaves; i++)
+      winners[leaves + i] = i;
+    for (size_t node = leaves - 1; node >= 1; node--) {
+      size_t left = winners[2 * node], right = winners[2 * node + 1];
+      bool right_wins = less(right, left);
+      winners[node] = right_wins ? right : left;
+      nodes[node] = right_wins ? left : right;
+    }
+    nodes[0] = leaves > 1 ? winners[1] : 0;
+  }
 
-void BufferManager::find_in_buffer(string buffer_name, string term) {
-  Buffer *buf = get_buffer(buffer_name);
-  if (!buf) {
-    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+  size_t winner() const { return nodes[0]; }
+
+  // Call after the winning run has moved on to its next line
+  void replay() {
+    size_t current = nodes[0];
+    for (size_t node = (leaves + current) / 2; node >= 1; node /= 2)
+      if (less(nodes[node], current))
+        swap(nodes[node], current);
+    nodes[0] = current;
+  }
+};
+
+volatile sig_atomic_t watch_should_stop = 0;
+void handle_watch_interrupt(int) { watch_should_stop = 1; }
+
+///////////////////////////////////////////////////////
+///////////////////////////////////////////////////////
+
+PageHeap &PageHeap::instance() {
+  static PageHeap heap;
+  return heap;
+}
+
+// Only block-sized requests are pooled, so rounding up to the class size
+// wastes at most half of it
+size_t PageHeap::size_class(size_t bytes) {
+  if (bytes <= min_class_size / 2)
+    return class_count;
+
+  size_t class_index = 0;
+  for (size_t size = min_class_size; size < bytes; size <<= 1)
+    class_index++;
+  return min(class_index, class_count);
+}
+
+// Maps a 2 MB-aligned range, preferring reserved huge pages (MAP_HUGETLB)
+// and falling back to transparent huge pages
+void *PageHeap::map_huge(size_t bytes, bool try_reserved) {
+  if (try_reserved) {
+    void *reserved = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (reserved != MAP_FAILED)
+      return reserved;
+  }
+
+  size_t span = bytes + huge_page_size;
+  void *mapped = mmap(nullptr, span, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapped == MAP_FAILED)
+    throw bad_alloc();
+
+  uintptr_t start = reinterpret_cast<uintptr_t>(mapped);
+  uintptr_t aligned = (start + huge_page_size - 1) & ~(huge_page_size - 1);
+  if (aligned > start)
+    munmap(mapped, aligned - start);
+  if (start + span > aligned + bytes)
+    munmap(reinterpret_cast<void *>(aligned + bytes),
+           start + span - aligned - bytes);
+
+  madvise(reinterpret_cast<void *>(aligned), bytes, MADV_HUGEPAGE);
+  return reinterpret_cast<void *>(aligned);
+}
+
+void *PageHeap::allocate(size_t bytes, bool huge_pages) {
+  if (bytes >= huge_page_size) {
+    size_t rounded = (bytes + huge_page_size - 1) & ~(huge_page_size - 1);
+    return map_huge(rounded, false);
+  }
+
+  size_t class_index = size_class(bytes);
+  if (!huge_pages || class_index == class_count)
+    return ::operator new(bytes);
+
+  lock_guard<mutex> guard(heap_lock);
+  vector<void *> &free_list = free_lists[class_index];
+  if (!free_list.empty()) {
+    void *ptr = free_list.back();
+    free_list.pop_back();
+    return ptr;
+  }
+
+  size_t class_size = min_class_size << class_index;
+  if (region_left < class_size) {
+    region_cursor = static_cast<char *>(map_huge(huge_page_size, true));
+    region_left = huge_page_size;
+    regions.insert(reinterpret_cast<uintptr_t>(region_cursor));
+  }
+
+  void *ptr = region_cursor;
+  region_cursor += class_size;
+  region_left -= class_size;
+  return ptr;
+}
+
+void PageHeap::deallocate(void *ptr, size_t bytes) {
+  if (bytes >= huge_page_size) {
+    munmap(ptr, (bytes + huge_page_size - 1) & ~(huge_page_size - 1));
+    return;
+  }
+
+  size_t class_index = size_class(bytes);
+  if (class_index != class_count) {
+    uintptr_t region =
+        reinterpret_cast<uintptr_t>(ptr) & ~(huge_page_size - 1);
+    lock_guard<mutex> guard(heap_lock);
+    if (regions.count(region)) {
+      free_lists[class_index].push_back(ptr);
+      return;
+    }
+  }
+
+  ::operator delete(ptr);
+}
+
+///////////////////////////////////////////////////////
+
+const char *LineArena::store(string_view text) {
+  bool huge = huge_pages && *huge_pages;
+
+  if (text.size() > max_block_size / 4) {
+    // Oversized payloads get a block of their own so the current one keeps
+    // filling up with ordinary lines
+    char *own_block =
+        static_cast<char *>(PageHeap::instance().allocate(text.size(), huge));
+    memcpy(own_block, text.data(), text.size());
+    blocks.push_back({own_block, text.size()});
+    reserved += text.size();
+    return own_block;
+  }
+
+  if (current_used + text.size() > current_size) {
+    current_size = current_size ? min(current_size * 2, max_block_size)
+                                : min_block_size;
+    current_block =
+        static_cast<char *>(PageHeap::instance().allocate(current_size, huge));
+    blocks.push_back({current_block, current_size});
+    current_used = 0;
+    reserved += current_size;
+  }
+
+  char *data = current_block + current_used;
+  memcpy(data, text.data(), text.size());
+  current_used += text.size();
+  return data;
+}
+
+void LineArena::release() {
+  for (const Chunk &block : blocks)
+    PageHeap::instance().deallocate(block.data, block.size);
+  blocks.clear();
+  current_block = nullptr;
+  current_used = 0;
+  current_size = 0;
+  reserved = 0;
+}
+
+void LineArena::swap(LineArena &other) {
+  blocks.swap(other.blocks);
+  std::swap(current_block, other.current_block);
+  std::swap(current_used, other.current_used);
+  std::swap(current_size, other.current_size);
+  std::swap(reserved, other.reserved);
+}
+
+void Line::point_to(const char *data, size_t length, unsigned char line_tag) {
+  memcpy(raw, &data, sizeof(data));
+  for (int i = 0; i < 7; i++)
+    raw[8 + i] = static_cast<char>(static_cast<uint64_t>(length) >> (8 * i));
+  raw[15] = static_cast<char>(line_tag);
+}
+
+Line::Line(string_view text, LineArena &arena) {
+  if (text.size() <= inline_capacity) {
+    memcpy(raw, text.data(), text.size());
+    raw[15] = static_cast<char>(text.size());
+    return;
+  }
+
+  point_to(arena.store(text), text.size(), long_tag);
+}
+
+Line Line::shared(string_view interned) {
+  Line line;
+  line.point_to(interned.data(), interned.size(), shared_tag);
+  return line;
+}
+
+size_t Line::size() const {
+  if (is_inline())
+    return tag();
+
+  uint64_t length = 0;
+  for (int i = 0; i < 7; i++)
+    length |= static_cast<uint64_t>(static_cast<unsigned char>(raw[8 + i]))
+              << (8 * i);
+  return length;
+}
+
+string_view Line::view() const {
+  if (is_inline())
+    return string_view(raw, tag());
+
+  const char *data;
+  memcpy(&data, raw, sizeof(data));
+  return string_view(data, size());
+}
+
+string_view InternTable::acquire(string_view text) {
+  auto it = refs.find(text);
+  if (it == refs.end()) {
+    string_view stored(storage.store(text), text.size());
+    it = refs.emplace(stored, 0).first;
+    distinct_bytes += text.size();
+  }
+
+  it->second++;
+  line_refs++;
+  referenced_bytes += text.size();
+  return it->first;
+}
+
+// Dropping the last reference leaves the payload in storage until the
+// buffer is compacted
+void InternTable::release(string_view interned) {
+  auto it = refs.find(interned);
+  if (it == refs.end())
+    return;
+
+  line_refs--;
+  referenced_bytes -= interned.size();
+  if (--it->second == 0) {
+    distinct_bytes -= interned.size();
+    refs.erase(it);
+  }
+}
+
+// Hands the payload storage to the caller and starts over empty; used to
+// re-intern the live lines into fresh storage
+void InternTable::take_storage(LineArena &out) {
+  storage.swap(out);
+  refs.clear();
+  distinct_bytes = 0;
+  referenced_bytes = 0;
+  line_refs = 0;
+}
+
+bool InternTable::is_fragmented() const {
+  return storage.bytes() > 2 * distinct_bytes + 64 * 1024;
+}
+
+double InternTable::dedup_ratio() const {
+  return distinct_bytes ? static_cast<double>(referenced_bytes) / distinct_bytes
+                        : 1.0;
+}
+
+///////////////////////////////////////////////////////
+
+Line LineBlock::make_line(string_view text) {
+  if (interned->enabled && text.size() > Line::inline_capacity)
+    return Line::shared(interned->acquire(text));
+
+  Line line(text, arena);
+  if (!line.is_inline())
+    long_line_bytes += line.size();
+  return line;
+}
+
+void LineBlock::forget_line(const Line &line) {
+  if (line.is_shared())
+    interned->release(line.view());
+  else if (!line.is_inline())
+    long_line_bytes -= line.size();
+}
+
+void LineBlock::release_shared_lines() {
+  if (!interned->enabled || !resident)
+    return;
+  for (const Line &line : lines)
+    if (line.is_shared())
+      interned->release(line.view());
+}
+
+// Packs the lines as length-prefixed records and drops the unpacked copy
+void LineBlock::pack() {
+  if (packed.empty()) {
+    string raw;
+    for (const Line &line : lines) {
+      string_view text = line.view();
+      for (size_t len = text.size(); ; len >>= 7) {
+        raw += static_cast<char>((len & 0x7f) | (len >= 0x80 ? 0x80 : 0));
+        if (len < 0x80)
+          break;
+      }
+      raw += text;
+    }
+    packed_raw_size = raw.size();
+    packed = lz_compress(raw);
+  }
+  drop_lines();
+}
+
+void LineBlock::unpack() {
+  string raw = lz_decompress(packed, packed_raw_size);
+  lines.reserve(count);
+
+  for (size_t pos = 0; pos < raw.size();) {
+    size_t len = 0;
+    for (int shift = 0;; shift += 7) {
+      unsigned char byte = static_cast<unsigned char>(raw[pos++]);
+      len |= static_cast<size_t>(byte & 0x7f) << shift;
+      if (!(byte & 0x80))
+        break;
+    }
+    lines.push_back(make_line(string_view(raw).substr(pos, len)));
+    pos += len;
+  }
+  resident = true;
+}
+
+void LineBlock::drop_lines() {
+  release_shared_lines();
+  decltype(lines)(lines.get_allocator()).swap(lines);
+  arena.release();
+  long_line_bytes = 0;
+  resident = false;
+}
+
+// Rewrites long payloads into a fresh arena once edits have left more than
+// half of it unreferenced
+void LineBlock::compact() {
+  if (!resident || arena.bytes() <= 2 * long_line_bytes + 4 * 1024)
+    return;
+
+  LineArena fresh(&huge_pages);
+  for (Line &line : lines)
+    if (!line.is_inline() && !line.is_shared())
+      line = Line(line.view(), fresh);
+  arena.swap(fresh);
+}
+
+size_t LineBlock::storage_bytes() const {
+  size_t bytes = sizeof(LineBlock) + packed.capacity();
+  if (resident)
+    bytes += lines.capacity() * sizeof(Line) + arena.bytes();
+  return bytes;
+}
+
+///////////////////////////////////////////////////////
+
+size_t Buffer::locate(size_t index, size_t &offset) const {
+  size_t block_index =
+      upper_bound(block_starts.begin(), block_starts.end(), index) -
+      block_starts.begin() - 1;
+  offset = index - block_starts[block_index];
+  return block_index;
+}
+
+// Returns a block with its lines materialized. Unpacking a cold block may
+// drop the least recently used other unpacked block, so a view returned by
+// line() stays valid across at least one further access.
+LineBlock &Buffer::readable_block(size_t block_index) const {
+  LineBlock &block = *blocks[block_index];
+  block.last_epoch = epoch;
+  block.last_use = ++use_clock;
+  if (block.resident)
+    return block;
+
+  block.unpack();
+  unpacked_blocks.push_back(&block);
+  if (unpacked_blocks.size() > unpacked_cache_blocks) {
+    auto oldest = min_element(unpacked_blocks.begin(), unpacked_blocks.end(),
+                              [](const LineBlock *a, const LineBlock *b) {
+                                return a->last_use < b->last_use;
+                              });
+    (*oldest)->drop_lines();
+    unpacked_blocks.erase(oldest);
+  }
+  return block;
+}
+
+// Like readable_block, but the block is made private to this buffer first
+// (copy-on-write) and its packed copy goes stale with the edit
+LineBlock &Buffer::writable_block(size_t block_index) {
+  LineBlock &block = readable_block(block_index);
+  if (blocks[block_index].use_count() > 1) {
+    auto copy = new_block();
+    copy->lines.reserve(block.count);
+    for (const Line &line : block.lines)
+      copy->lines.push_back(copy->make_line(line.view()));
+    copy->count = block.count;
+    copy->text_bytes = block.text_bytes;
+
+    forget_unpacked(&block);
+    blocks[block_index] = std::move(copy);
+    return *blocks[block_index];
+  }
+
+  if (!block.packed.empty()) {
+    forget_unpacked(&block);
+    string().swap(block.packed);
+  }
+  return block;
+}
+
+void Buffer::forget_unpacked(LineBlock *block) const {
+  auto it = find(unpacked_blocks.begin(), unpacked_blocks.end(), block);
+  if (it != unpacked_blocks.end())
+    unpacked_blocks.erase(it);
+}
+
+void Buffer::shift_block_starts(size_t after_block, ptrdiff_t delta) {
+  for (size_t i = after_block + 1; i < block_starts.size(); i++)
+    block_starts[i] += delta;
+}
+
+// Creates an empty block, switching the buffer to huge-page backed storage
+// once it outgrows the threshold
+shared_ptr<LineBlock> Buffer::new_block() {
+  if (!huge_pages &&
+      text_bytes + total_lines * sizeof(Line) > huge_page_threshold()) {
+    huge_pages = true;
+    interned->use_huge_pages();
+  }
+
+  auto block = make_shared<LineBlock>(huge_pages, interned);
+  block->last_epoch = epoch;
+  return block;
+}
+
+// Moves the upper half of a full block into a new block of its own
+void Buffer::split_block(size_t block_index) {
+  LineBlock &block = writable_block(block_index);
+  size_t keep = block.count / 2;
+
+  auto upper = new_block();
+  upper->lines.reserve(block.count - keep);
+  for (size_t i = keep; i < block.count; i++) {
+    upper->lines.push_back(upper->make_line(block.lines[i].view()));
+    upper->text_bytes += block.lines[i].size();
+    block.forget_line(block.lines[i]);
+  }
+  upper->count = block.count - keep;
+  block.text_bytes -= upper->text_bytes;
+
+  block.lines.resize(keep);
+  block.count = keep;
+  block.compact();
+
+  block_starts.insert(block_starts.begin() + block_index + 1,
+                      block_starts[block_index] + keep);
+  blocks.insert(blocks.begin() + block_index + 1, std::move(upper));
+  byte_tree_stale = true;
+}
+
+string_view Buffer::line(size_t index) const {
+  size_t offset;
+  size_t block_index = locate(index, offset);
+  return readable_block(block_index).lines[offset].view();
+}
+
+// The new Line is always built before the block is touched, so the text may
+// be a view of another line in this same buffer.
+void Buffer::set_line(size_t index, string_view text) {
+  size_t offset;
+  size_t block_index = locate(index, offset);
+  LineBlock &block = writable_block(block_index);
+  Line updated = block.make_line(text);
+  ptrdiff_t delta = updated.size() - block.lines[offset].size();
+  unindex_line(index, block.lines[offset].view());
+  index_line(index, updated.view());
+  count_length(block.lines[offset].size(), -1);
+  count_length(updated.size(), 1);
+  add_block_bytes(block_index, delta);
+  text_bytes += delta;
+  block.text_bytes += delta;
+  block.forget_line(block.lines[offset]);
+  block.lines[offset] = updated;
+}
+
+void Buffer::insert_line(size_t index, string_view text) {
+  if (index >= total_lines) {
+    append_line(text);
+    return;
+  }
+
+  size_t offset;
+  size_t block_index = locate(index, offset);
+
+  // Split ahead of the insert so a block never exceeds max_lines (and, in
+  // huge-page mode, never outgrows its preallocated line table)
+  string split_copy;
+  if (blocks[block_index]->count >= LineBlock::max_lines) {
+    split_copy = text; // The text may be a view into the block being split
+    text = split_copy;
+    split_block(block_index);
+    block_index = locate(index, offset);
+  }
+
+  LineBlock &block = writable_block(block_index);
+  Line inserted = block.make_line(text);
+  block.lines.insert(block.lines.begin() + offset, inserted);
+  block.count++;
+  block.text_bytes += text.size();
+  total_lines++;
+  text_bytes += text.size();
+  shift_block_starts(block_index, 1);
+  shift_index(index, 1);
+  index_line(index, block.lines[offset].view());
+  count_length(text.size(), 1);
+  add_block_bytes(block_index, text.size() + 1);
+  shift_marks(index, 1);
+}
+
+void Buffer::erase_line(size_t index) {
+  size_t offset;
+  size_t block_index = locate(index, offset);
+  LineBlock &block = writable_block(block_index);
+  unindex_line(index, block.lines[offset].view());
+  block.forget_line(block.lines[offset]);
+  count_length(block.lines[offset].size(), -1);
+  add_block_bytes(block_index, -(block.lines[offset].size() + 1));
+  text_bytes -= block.lines[offset].size();
+  block.text_bytes -= block.lines[offset].size();
+  block.lines.erase(block.lines.begin() + offset);
+  block.count--;
+  total_lines--;
+  shift_block_starts(block_index, -1);
+  shift_index(index + 1, -1);
+  shift_marks(index, -1);
+
+  if (block.count == 0) {
+    blocks.erase(blocks.begin() + block_index);
+    block_starts.erase(block_starts.begin() + block_index);
+    byte_tree_stale = true;
+  }
+}
+
+void Buffer::move_line(size_t from, size_t to) {
+  vector<string> moved_marks;
+  for (const auto &[mark, index] : marks)
+    if (index == from)
+      moved_marks.push_back(mark);
+
+  string moved(line(from));
+  erase_line(from);
+  insert_line(to, moved);
+  for (const string &mark : moved_marks)
+    marks[mark] = to;
+}
+
+void Buffer::append_line(string_view text) {
+  // Appending after a shared block starts a new one instead of copying it
+  if (blocks.empty() || blocks.back()->count >= LineBlock::max_lines ||
+      blocks.back().use_count() > 1) {
+    block_starts.push_back(total_lines);
+    blocks.push_back(new_block());
+    byte_tree_stale = true;
+  }
+
+  LineBlock &block = writable_block(blocks.size() - 1);
+  block.lines.push_back(block.make_line(text));
+  block.count++;
+  block.text_bytes += text.size();
+  total_lines++;
+  text_bytes += text.size();
+  index_line(total_lines - 1, block.lines.back().view());
+  count_length(text.size(), 1);
+  add_block_bytes(blocks.size() - 1, text.size() + 1);
+}
+
+void Buffer::clear_lines() {
+  blocks.clear();
+  block_starts.clear();
+  unpacked_blocks.clear();
+  total_lines = 0;
+  text_bytes = 0;
+  huge_pages = false;
+  invalidate_index();
+  line_lengths.clear();
+  byte_tree_stale = true;
+
+  // The table may still back blocks of clones, so start a new one
+  interned = make_shared<InternTable>(interned->enabled);
+}
+
+void Buffer::compact() {
+  long table_users = 1;
+  for (auto &block : blocks) {
+    if (block.use_count() > 1)
+      continue; // Shared blocks are immutable
+    block->compact();
+    if (block->interned == interned)
+      table_users++;
+  }
+
+  // The intern table can only be rebuilt while every line referencing it
+  // belongs to this buffer
+  if (!interned->is_fragmented() || interned.use_count() != table_users)
+    return;
+
+  // Re-intern every live shared line into fresh storage; the old storage
+  // stays valid until all lines have been moved off it
+  LineArena old_storage;
+  interned->take_storage(old_storage);
+  for (auto &block : blocks) {
+    if (!block->resident || block->interned != interned)
+      continue;
+    for (Line &line : block->lines)
+      if (line.is_shared())
+        line = Line::shared(interned->acquire(line.view()));
+  }
+}
+
+// Makes this buffer a copy-on-write clone of source: both point at the same
+// blocks until one of them edits a block
+void Buffer::share_lines(const Buffer &source) {
+  clear_lines();
+  blocks = source.blocks;
+  block_starts = source.block_starts;
+  total_lines = source.total_lines;
+  text_bytes = source.text_bytes;
+  huge_pages = source.huge_pages;
+  interned = source.interned;
+  invalidate_index();
+  line_lengths = source.line_lengths;
+  byte_tree_stale = true;
+  marks = source.marks;
+}
+
+// Makes this buffer hold lines [first, last] of source
+void Buffer::share_range(const Buffer &source, size_t first, size_t last) {
+  clear_lines();
+  huge_pages = source.huge_pages;
+  append_range(source, first, last);
+}
+
+// Appends lines [first, last] of source. Blocks lying wholly inside the range
+// are shared copy-on-write, as with share_lines; only the partially covered
+// blocks at either end have their lines copied.
+void Buffer::append_range(const Buffer &source, size_t first, size_t last) {
+  invalidate_index();
+  byte_tree_stale = true;
+  size_t offset;
+  size_t block_index = source.locate(first, offset);
+  for (size_t index = first; index <= last; block_index++) {
+    const shared_ptr<LineBlock> &block = source.blocks[block_index];
+    size_t block_start = source.block_starts[block_index];
+    size_t block_end = block_start + block->count; // One past its last line
+
+    if (index == block_start && block_end <= last + 1) {
+      block_starts.push_back(total_lines);
+      blocks.push_back(block);
+      total_lines += block->count;
+      text_bytes += block->text_bytes;
+      for (const Line &line : source.readable_block(block_index).lines)
+        count_length(line.size(), 1);
+    } else {
+      for (; index < block_end && index <= last; index++)
+        append_line(source.line(index));
+    }
+    index = block_end;
+  }
+}
+
+// Unpacks every block for good, so views of all lines stay valid until the
+// next edit or cold compression pass
+void Buffer::materialize() const {
+  for (size_t i = 0; i < blocks.size(); i++) {
+    readable_block(i);
+    forget_unpacked(blocks[i].get());
+  }
+}
+
+// Replaces the contents with new_lines, which may be views of this buffer's
+// current lines. origins[i] is the current index of new line i; marks move
+// with their lines, and marks on lines that are not kept are dropped.
+void Buffer::replace_lines(const vector<string_view> &new_lines,
+                           const vector<size_t> &origins) {
+  auto old_blocks = std::move(blocks); // Keeps the viewed payloads alive
+  clear_lines();
+  for (string_view text : new_lines)
+    append_line(text);
+
+  if (marks.empty())
+    return;
+  unordered_map<size_t, size_t> moved; // Old index -> new index
+  for (const auto &[mark, index] : marks)
+    moved.emplace(index, SIZE_MAX);
+  for (size_t i = 0; i < origins.size(); i++) {
+    auto line = moved.find(origins[i]);
+    if (line != moved.end() && line->second == SIZE_MAX)
+      line->second = i;
+  }
+  for (auto mark = marks.begin(); mark != marks.end();) {
+    size_t index = moved[mark->second];
+    if (index == SIZE_MAX) {
+      mark = marks.erase(mark);
+    } else {
+      mark->second = index;
+      ++mark;
+    }
+  }
+}
+
+// Packs every block not accessed during the last idle_epochs commands and
+// drops the unpacked copies of cold blocks that were only read
+void Buffer::compress_cold_blocks(unsigned long idle_epochs) {
+  for (auto &block : blocks) {
+    if (!block->resident || epoch - block->last_epoch < idle_epochs)
+      continue;
+    forget_unpacked(block.get());
+    block->pack();
+  }
+}
+
+// Adjusts marks for a line inserted (delta 1) or erased (delta -1) at index.
+// A mark on an erased line moves to the line that took its place.
+void Buffer::shift_marks(size_t index, ptrdiff_t delta) {
+  for (auto &[mark, position] : marks) {
+    if (position > index || (delta > 0 && position == index))
+      position += delta;
+    else if (position == index && position == total_lines && position > 0)
+      position--;
+  }
+}
+
+void Buffer::count_length(size_t length, ptrdiff_t delta) {
+  auto it = line_lengths.emplace(length, 0).first;
+  it->second += delta;
+  if (it->second == 0)
+    line_lengths.erase(it);
+}
+
+void Buffer::add_block_bytes(size_t block_index, ptrdiff_t delta) {
+  if (byte_tree_stale)
+    return;
+  for (size_t i = block_index + 1; i <= block_byte_tree.size(); i += i & -i)
+    block_byte_tree[i - 1] += delta;
+}
+
+void Buffer::rebuild_byte_tree() const {
+  size_t n = blocks.size();
+  block_byte_tree.assign(n, 0);
+  for (size_t i = 1; i <= n; i++) {
+    block_byte_tree[i - 1] += blocks[i - 1]->text_bytes + blocks[i - 1]->count;
+    size_t parent = i + (i & -i);
+    if (parent <= n)
+      block_byte_tree[parent - 1] += block_byte_tree[i - 1];
+  }
+  byte_tree_stale = false;
+}
+
+size_t Buffer::line_offset(size_t index) const {
+  if (byte_tree_stale)
+    rebuild_byte_tree();
+
+  size_t offset;
+  size_t block_index = locate(index, offset);
+  size_t bytes = 0;
+  for (size_t i = block_index; i > 0; i -= i & -i)
+    bytes += block_byte_tree[i - 1];
+
+  const LineBlock &block = readable_block(block_index);
+  for (size_t i = 0; i < offset; i++)
+    bytes += block.lines[i].size() + 1;
+  return bytes;
+}
+
+// Returns the index of the line holding byte offset (which must be below
+// byte_count()), and the offset's column within that line
+size_t Buffer::line_at_offset(size_t offset, size_t &column) const {
+  if (byte_tree_stale)
+    rebuild_byte_tree();
+
+  // Descend the tree to the last block starting at or before the offset
+  size_t block_index = 0;
+  size_t step = 1;
+  while (step * 2 <= block_byte_tree.size())
+    step *= 2;
+  for (; step > 0; step /= 2) {
+    size_t next = block_index + step;
+    if (next <= block_byte_tree.size() && block_byte_tree[next - 1] <= offset) {
+      block_index = next;
+      offset -= block_byte_tree[next - 1];
+    }
+  }
+
+  const LineBlock &block = readable_block(block_index);
+  size_t line = 0;
+  while (offset > block.lines[line].size()) {
+    offset -= block.lines[line].size() + 1;
+    line++;
+  }
+  column = offset;
+  return block_starts[block_index] + line;
+}
+
+void Buffer::create_index(size_t column, char delimiter) {
+  column_index = make_unique<ColumnIndex>(column, delimiter);
+}
+
+size_t Buffer::index_key_hash(string_view line) const {
+  return hash<string_view>()(
+      field_view(line, column_index->column, column_index->delimiter));
+}
+
+void Buffer::index_line(size_t index, string_view line) {
+  if (column_index && !column_index->stale)
+    column_index->lines.emplace(
+        index_key_hash(line),
+        ColumnIndex::Entry{index, column_index->shifts.size()});
+}
+
+void Buffer::unindex_line(size_t index, string_view line) {
+  if (!column_index || column_index->stale)
+    return;
+  auto range = column_index->lines.equal_range(index_key_hash(line));
+  for (auto it = range.first; it != range.second; ++it) {
+    if (column_index->position(it->second) == index) {
+      column_index->lines.erase(it);
+      return;
+    }
+  }
+}
+
+void Buffer::shift_index(size_t from, ptrdiff_t delta) {
+  if (!column_index || column_index->stale)
+    return;
+  if (column_index->shifts.size() >= ColumnIndex::max_shifts)
+    invalidate_index();
+  else
+    column_index->shifts.emplace_back(from, delta);
+}
+
+// Applies the logged shifts to every entry and empties the log
+void Buffer::resolve_index() {
+  if (!column_index || column_index->stale || column_index->shifts.empty())
+    return;
+  for (auto &[hash, entry] : column_index->lines)
+    entry = {column_index->position(entry), 0};
+  column_index->shifts.clear();
+}
+
+// Takes over entries built for the buffer's current lines, e.g. persisted by
+// an earlier process
+void Buffer::restore_index(
+    unordered_multimap<size_t, ColumnIndex::Entry> lines) {
+  if (!column_index)
+    return;
+  column_index->lines = std::move(lines);
+  column_index->shifts.clear();
+  column_index->stale = false;
+}
+
+// Returns the indices of the lines whose indexed column equals key, in
+// order, rebuilding the index first if it went stale
+vector<size_t> Buffer::lookup(string_view key) {
+  vector<size_t> matches;
+  if (!column_index)
+    return matches;
+
+  ColumnIndex &index = *column_index;
+  if (index.stale) {
+    index.lines.clear();
+    index.shifts.clear();
+    index.lines.reserve(total_lines);
+    for (size_t i = 0; i < total_lines; i++)
+      index.lines.emplace(index_key_hash(line(i)), ColumnIndex::Entry{i, 0});
+    index.stale = false;
+  }
+
+  auto range = index.lines.equal_range(hash<string_view>()(key));
+  for (auto it = range.first; it != range.second; ++it) {
+    size_t i = index.position(it->second);
+    if (field_view(line(i), index.column, index.delimiter) == key)
+      matches.push_back(i);
+  }
+  sort(matches.begin(), matches.end());
+  return matches;
+}
+
+size_t Buffer::storage_bytes() const {
+  size_t bytes = interned->storage_bytes();
+  if (column_index)
+    bytes += column_index->lines.bucket_count() * sizeof(void *) +
+             column_index->lines.size() * 5 * sizeof(size_t);
+  for (const auto &block : blocks)
+    bytes += block->storage_bytes();
+  return bytes;
+}
+
+BufferPool::~BufferPool() {
+  for (void *slab : slabs)
+    ::operator delete(slab);
+}
+
+Buffer *BufferPool::acquire(string_view name) {
+  if (free_slots.empty()) {
+    char *slab =
+        static_cast<char *>(::operator new(slab_capacity * sizeof(Buffer)));
+    slabs.push_back(slab);
+    for (size_t i = slab_capacity; i > 0; i--)
+      free_slots.push_back(slab + (i - 1) * sizeof(Buffer));
+  }
+
+  void *slot = free_slots.back();
+  free_slots.pop_back();
+  return new (slot) Buffer(string(name));
+}
+
+void BufferPool::release(Buffer *buf) {
+  buf->~Buffer();
+  free_slots.push_back(buf);
+}
+
+size_t BufferRegistry::probe(string_view name, size_t hash) const {
+  size_t mask = slots.size() - 1;
+  size_t index = hash & mask;
+  size_t first_deleted = slots.size();
+
+  while (slots[index].state != EMPTY) {
+    if (slots[index].state == DELETED) {
+      if (first_deleted == slots.size())
+        first_deleted = index;
+    } else if (slots[index].hash == hash && slots[index].buffer->name == name) {
+      return index;
+    }
+    index = (index + 1) & mask;
+  }
+
+  return first_deleted != slots.size() ? first_deleted : index;
+}
+
+void BufferRegistry::rehash(size_t capacity) {
+  vector<Slot> old_slots(capacity, Slot{0, nullptr, EMPTY});
+  old_slots.swap(slots);
+  occupied = 0;
+  deleted = 0;
+
+  for (const Slot &slot : old_slots)
+    if (slot.state == OCCUPIED)
+      insert(slot.buffer);
+}
+
+Buffer *BufferRegistry::find(string_view name) const {
+  const Slot &slot = slots[probe(name, hash<string_view>{}(name))];
+  return slot.state == OCCUPIED ? slot.buffer : nullptr;
+}
+
+void BufferRegistry::insert(Buffer *buf) {
+  // Keep the load factor (tombstones included) under 3/4
+  if ((occupied + deleted + 1) * 4 > slots.size() * 3)
+    rehash(occupied * 4 > slots.size() ? slots.size() * 2 : slots.size());
+
+  size_t hash = std::hash<string_view>{}(buf->name);
+  Slot &slot = slots[probe(buf->name, hash)];
+  if (slot.state == OCCUPIED) {
+    slot.buffer = buf;
+    return;
+  }
+  if (slot.state == DELETED)
+    deleted--;
+
+  slot = Slot{hash, buf, OCCUPIED};
+  occupied++;
+}
+
+bool BufferRegistry::erase(string_view name) {
+  Slot &slot = slots[probe(name, hash<string_view>{}(name))];
+  if (slot.state != OCCUPIED)
+    return false;
+
+  slot.state = DELETED;
+  slot.buffer = nullptr;
+  occupied--;
+  deleted++;
+  return true;
+}
+
+BufferManager::BufferManager() {
+  current_buffer = nullptr;
+  temp_directory = "/tmp/bff_buffers/";
+
+  const char *budget = getenv("BFF_MEMORY_BUDGET");
+  memory_budget = budget ? parse_byte_size(budget) : 0;
+  access_clock = 0;
+  cache_hits = 0;
+  cache_misses = 0;
+  cache_evictions = 0;
+
+  const char *compress_after = getenv("BFF_COMPRESS_COLD");
+  compress_after_commands = compress_after ? stoul(compress_after) : 0;
+  command_epoch = 0;
+
+  const char *intern = getenv("BFF_INTERN");
+  intern_lines = intern && string(intern) != "0";
+  defer_persistence = false;
+  in_transaction = false;
+
+  if (!filesystem::exists(temp_directory))
+    filesystem::create_directories(temp_directory);
+}
+
+BufferManager::~BufferManager() {
+  buffers.for_each([this](Buffer *buf) {
+    save_buffer_to_temp(buf);
+    buffer_pool.release(buf);
+  });
+}
+
+Buffer *BufferManager::create_buffer(string_view name) {
+  Buffer *existing = buffers.find(name);
+  if (existing) {
+    log_undo(existing, true);
+    return existing; // Buffer already exists
+  }
+
+  Buffer *new_buffer = buffer_pool.acquire(name);
+  if (intern_lines)
+    new_buffer->enable_interning();
+  buffers.insert(new_buffer);
+  touch_buffer(new_buffer);
+  log_undo(new_buffer, false);
+  return new_buffer;
+}
+
+Buffer *BufferManager::get_buffer(string_view name) {
+  Buffer *buf = buffers.find(name);
+  if (buf) {
+    cache_hits++;
+    touch_buffer(buf);
+    log_undo(buf, true);
+    return buf;
+  }
+
+  cache_misses++;
+  load_buffer_from_temp(name);
+  buf = buffers.find(name);
+  if (buf)
+    return buf;
+
+  return create_buffer(name);
+}
+
+bool BufferManager::select_buffer(string_view name) {
+  Buffer *buf = buffers.find(name);
+  if (buf) {
+    current_buffer = buf;
+    touch_buffer(current_buffer);
+    return true;
+  }
+
+  load_buffer_from_temp(name);
+  buf = buffers.find(name);
+  if (buf) {
+    current_buffer = buf;
+    return true;
+  }
+
+  return false;
+}
+
+void BufferManager::log_undo(Buffer *buf, bool resident) {
+  if (!in_transaction || undo_log.count(buf->name))
+    return;
+
+  Buffer *snapshot = nullptr;
+  if (resident) {
+    snapshot = buffer_pool.acquire(buf->name);
+    snapshot->share_lines(*buf);
+    snapshot->file_path = buf->file_path;
+    snapshot->is_modified = buf->is_modified;
+    snapshot->dirty = buf->dirty;
+    snapshot->overwrite_pending = buf->overwrite_pending;
+  }
+  undo_log[buf->name] = snapshot;
+}
+
+bool BufferManager::begin_transaction() {
+  if (in_transaction || !defer_persistence)
+    return false;
+  in_transaction = true;
+  return true;
+}
+
+// Persists the buffers the transaction touched as a unit. Their locks are
+// taken in name order, as clone_buffer does, and every version is checked
+// (merging concurrent edits that do not conflict) before any temp copy is
+// written. The new copies are renamed into place only once all of them are
+// staged. On a conflict or failed write nothing is persisted and the
+// transaction is rolled back.
+bool BufferManager::commit_transaction() {
+  if (!in_transaction)
+    return false;
+  in_transaction = false;
+
+  vector<Buffer *> touched;
+  for (const auto &entry : undo_log)
+    if (Buffer *buf = buffers.find(entry.first))
+      touched.push_back(buf);
+  sort(touched.begin(), touched.end(),
+       [](const Buffer *a, const Buffer *b) { return a->name < b->name; });
+
+  bool ok = true;
+  vector<int> locks;
+  vector<unsigned long> versions;
+  for (Buffer *buf : touched) {
+    int lock_fd = lock_buffer(buf->name, LOCK_EX);
+    if (lock_fd < 0) {
+      cerr << "Error: could not lock buffer '" << buf->name << "' ("
+           << strerror(errno) << ")" << endl;
+      ok = false;
+      break;
+    }
+    locks.push_back(lock_fd);
+    versions.push_back(read_persisted_version(buf->name));
+  }
+
+  for (size_t i = 0; ok && i < touched.size(); i++) {
+    Buffer *buf = touched[i];
+    if (!buf->dirty || buf->overwrite_pending || versions[i] == buf->version)
+      continue;
+    if (!merge_concurrent_edits(buf)) {
+      cerr << "Error: buffer '" << buf->name
+           << "' was changed by another process and the edits conflict."
+           << endl;
+      ok = false;
+    }
+  }
+
+  vector<Buffer *> staged;
+  for (size_t i = 0; ok && i < touched.size(); i++) {
+    if (!touched[i]->dirty)
+      continue;
+    if (!stage_temp_copy(touched[i])) {
+      cerr << "Error: could not write buffer '" << touched[i]->name << "' ("
+           << strerror(errno) << ")" << endl;
+      ok = false;
+    } else {
+      staged.push_back(touched[i]);
+    }
+  }
+
+  if (!ok) {
+    for (Buffer *buf : staged)
+      unlink((temp_directory + buf->name + ".tmp.new").c_str());
+    for (int lock_fd : locks)
+      close(lock_fd);
+    restore_undo_log();
+    return false;
+  }
+
+  bool committed = true;
+  for (size_t i = 0; i < touched.size(); i++) {
+    Buffer *buf = touched[i];
+    if (!buf->dirty) {
+      if (versions[i] == buf->version &&
+          buf->mark_positions() != buf->base_marks)
+        commit_marks(buf); // Marks were set or deleted
+      continue;
+    }
+
+    string temp_file_path = temp_directory + buf->name + ".tmp";
+    if (rename((temp_file_path + ".new").c_str(), temp_file_path.c_str()) !=
+        0) {
+      cerr << "Error: could not write buffer '" << buf->name << "' ("
+           << strerror(errno) << ")" << endl;
+      committed = false;
+      continue;
+    }
+    commit_persisted_metadata(buf, versions[i] + 1);
+    buf->dirty = false;
+    buf->overwrite_pending = false;
+    buf->compact();
+    buf->memory_footprint = buffer_footprint(buf);
+  }
+
+  for (int lock_fd : locks)
+    close(lock_fd);
+  for (auto &[name, snapshot] : undo_log)
+    if (snapshot)
+      buffer_pool.release(snapshot);
+  undo_log.clear();
+  return committed;
+}
+
+void BufferManager::abort_transaction() {
+  if (!in_transaction)
+    return;
+
+  in_transaction = false;
+  restore_undo_log();
+}
+
+// Puts every buffer in the undo log back the way the transaction found it
+void BufferManager::restore_undo_log() {
+  for (auto &[name, snapshot] : undo_log) {
+    Buffer *buf = buffers.find(name);
+    if (buf && snapshot) {
+      buf->share_lines(*snapshot);
+      buf->file_path = snapshot->file_path;
+      buf->is_modified = snapshot->is_modified;
+      buf->dirty = snapshot->dirty;
+      buf->overwrite_pending = snapshot->overwrite_pending;
+      buf->memory_footprint = buffer_footprint(buf);
+    } else if (buf) {
+      if (buf == current_buffer)
+        current_buffer = nullptr;
+      buffers.erase(name);
+      buffer_pool.release(buf);
+    }
+    if (snapshot)
+      buffer_pool.release(snapshot);
+  }
+  undo_log.clear();
+}
+
+int BufferManager::lock_buffer(const string &name, int operation) {
+  string lock_file_path = temp_directory + name + ".lock";
+  int lock_fd = open(lock_file_path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (lock_fd < 0)
+    return -1;
+
+  while (flock(lock_fd, operation) < 0) {
+    if (errno != EINTR) {
+      close(lock_fd);
+      return -1;
+    }
+  }
+  return lock_fd;
+}
+
+unsigned long BufferManager::read_persisted_version(const string &name) {
+  unsigned long version = 0;
+  ifstream version_file(temp_directory + name + ".ver");
+  if (version_file.is_open())
+    version_file >> version;
+  return version;
+}
+
+// A change that replaced lines [start, old_end) with lines [start, new_end).
+// map() takes a line index from before the change to after it; indices in
+// the replaced range keep their offset while the new range lasts and move
+// to the line after it otherwise.
+struct RegionChange {
+  size_t start = 0;
+  size_t old_end = 0;
+  size_t new_end = 0;
+
+  size_t map(size_t index) const {
+    if (index < start)
+      return index;
+    if (index >= old_end)
+      return index - old_end + new_end;
+    return min(index, new_end);
+  }
+};
+
+// Three-way merge of this process' edits with the ones another process
+// persisted since the buffer was loaded. Each side's change is reduced to the
+// single region of the base it touches; disjoint regions are spliced together.
+bool BufferManager::merge_concurrent_edits(Buffer *buf) {
+  vector<string> base = read_lines_from_fd(buf->base_fd);
+  vector<string> theirs;
+  int theirs_fd = open((temp_directory + buf->name + ".tmp").c_str(), O_RDONLY);
+  if (theirs_fd >= 0) {
+    theirs = read_lines_from_fd(theirs_fd);
+    close(theirs_fd);
+  }
+  vector<string> ours;
+  ours.reserve(buf->line_count());
+  for (size_t i = 0; i < buf->line_count(); i++)
+    ours.emplace_back(buf->line(i));
+
+  auto changed_region = [&base](const vector<string> &side, size_t &start,
+                                size_t &base_end) {
+    size_t common = min(base.size(), side.size());
+    start = 0;
+    while (start < common && base[start] == side[start])
+      start++;
+
+    size_t tail = 0;
+    while (tail < common - start &&
+           base[base.size() - 1 - tail] == side[side.size() - 1 - tail])
+      tail++;
+    base_end = base.size() - tail;
+  };
+
+  size_t ours_start, ours_end, theirs_start, theirs_end;
+  changed_region(ours, ours_start, ours_end);
+  changed_region(theirs, theirs_start, theirs_end);
+
+  bool ours_unchanged = ours_start == ours_end && ours.size() == base.size();
+  bool theirs_unchanged =
+      theirs_start == theirs_end && theirs.size() == base.size();
+
+  size_t ours_new_end = ours_end + ours.size() - base.size();
+  size_t theirs_new_end = theirs_end + theirs.size() - base.size();
+
+  // Each side's change as seen from the other side's lines, to carry that
+  // side's marks into the merged lines
+  RegionChange ours_change = {ours_start, ours_end, ours_new_end};
+  RegionChange theirs_change = {theirs_start, theirs_end, theirs_new_end};
+  RegionChange theirs_to_merged, ours_to_merged;
+  vector<string> merged;
+  if (ours_unchanged) {
+    merged = theirs;
+    theirs_to_merged = theirs_change;
+  } else if (theirs_unchanged) {
+    merged = ours;
+    ours_to_merged = ours_change;
+  } else if (ours_start == theirs_start && ours_end == theirs_end &&
+             ours == theirs) {
+    merged = ours; // Both sides made the same edit
+  } else if (ours_end <= theirs_start && !(ours_start == ours_end &&
+                                           theirs_start == theirs_end &&
+                                           ours_end == theirs_start)) {
+    merged.assign(ours.begin(), ours.begin() + ours_new_end);
+    merged.insert(merged.end(), theirs.begin() + ours_end, theirs.end());
+    size_t shift = ours_new_end - ours_end; // Modular, may be "negative"
+    theirs_to_merged = {theirs_start + shift, theirs_end + shift,
+                        theirs_new_end + shift};
+    ours_to_merged = ours_change;
+  } else if (theirs_end <= ours_start) {
+    merged.assign(theirs.begin(), theirs.begin() + theirs_new_end);
+    merged.insert(merged.end(), ours.begin() + theirs_end, ours.end());
+    size_t shift = theirs_new_end - theirs_end;
+    theirs_to_merged = theirs_change;
+    ours_to_merged = {ours_start + shift, ours_end + shift,
+                      ours_new_end + shift};
+  } else {
+    return false; // Both processes edited the same lines
+  }
+
+  // Three-way merge of the marks: a mark set, moved or deleted on one side
+  // since the base takes that side's state (ours if both), and the others
+  // follow their lines
+  const map<string, size_t> &base_marks = buf->base_marks;
+  map<string, size_t> ours_marks = buf->mark_positions();
+  map<string, size_t> theirs_marks = read_marks(buf->name);
+  auto changed = [&base_marks](const map<string, size_t> &side,
+                               const RegionChange &change,
+                               const string &mark) {
+    auto in_side = side.find(mark);
+    auto in_base = base_marks.find(mark);
+    if ((in_side == side.end()) != (in_base == base_marks.end()))
+      return true;
+    return in_side != side.end() &&
+           in_side->second != change.map(in_base->second);
+  };
+  map<string, size_t> merged_marks;
+  auto take = [&merged_marks, &merged](const map<string, size_t> &side,
+                                       const RegionChange &change,
+                                       const string &mark) {
+    auto in_side = side.find(mark);
+    if (in_side != side.end() && !merged.empty())
+      merged_marks[mark] = min(change.map(in_side->second), merged.size() - 1);
+  };
+  set<string> names;
+  for (const auto &side : {base_marks, ours_marks, theirs_marks})
+    for (const auto &entry : side)
+      names.insert(entry.first);
+  for (const string &mark : names) {
+    if (changed(ours_marks, ours_change, mark) ||
+        !changed(theirs_marks, theirs_change, mark))
+      take(ours_marks, theirs_to_merged, mark);
+    else
+      take(theirs_marks, ours_to_merged, mark);
+  }
+
+  buf->clear_lines();
+  for (const auto &line : merged)
+    buf->append_line(line);
+  buf->clear_marks();
+  for (const auto &[mark, index] : merged_marks)
+    buf->set_mark(mark, index);
+  return true;
+}
+
+// Writes the buffer's lines to <name>.tmp.new, to be renamed over the temp
+// copy. A failed write removes the staged file.
+bool BufferManager::stage_temp_copy(Buffer *buf) {
+  string staged_file_path = temp_directory + buf->name + ".tmp.new";
+  ofstream temp_file(staged_file_path);
+  if (!temp_file.is_open())
+    return false;
+
+  for (size_t i = 0; i < buf->line_count(); i++)
+    temp_file << buf->line(i) << "\n";
+  temp_file.close();
+  if (temp_file.fail()) {
+    unlink(staged_file_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool BufferManager::save_buffer_to_temp(Buffer *buf, bool overwrite) {
+  if (!buf)
+    return false;
+
+  if (defer_persistence) {
+    buf->dirty = true;
+    buf->overwrite_pending |= overwrite;
+    buf->memory_footprint = buffer_footprint(buf);
+    return true;
+  }
+
+  int lock_fd = lock_buffer(buf->name, LOCK_EX);
+  if (lock_fd < 0) {
+    cerr << "Error: could not lock buffer '" << buf->name << "' ("
+         << strerror(errno) << ")" << endl;
+    return false;
+  }
+
+  // Compare-and-swap on the persisted version: if another process committed
+  // since this buffer was loaded, fold its edits in before writing.
+  unsigned long persisted_version = read_persisted_version(buf->name);
+  if (!overwrite && persisted_version != buf->version &&
+      !merge_concurrent_edits(buf)) {
+    cerr << "Error: buffer '" << buf->name
+         << "' was changed by another process and the edits conflict."
+         << endl;
+    close(lock_fd);
+    load_buffer_from_temp(buf->name); // Drop the rejected edit
+    return false;
+  }
+
+  string temp_file_path = temp_directory + buf->name + ".tmp";
+  if (!stage_temp_copy(buf) ||
+      rename((temp_file_path + ".new").c_str(), temp_file_path.c_str()) != 0) {
+    cerr << "Error: could not write buffer '" << buf->name << "' ("
+         << strerror(errno) << ")" << endl;
+    unlink((temp_file_path + ".new").c_str());
+    close(lock_fd);
+    return false;
+  }
+
+  commit_persisted_metadata(buf, persisted_version + 1);
+  buf->dirty = false;
+  buf->overwrite_pending = false;
+  buf->compact();
+  buf->memory_footprint = buffer_footprint(buf);
+
+  close(lock_fd);
+  return true;
+}
+
+// Writes the marks file. Called with the buffer's lock held, once the temp
+// copy is known to be the one the marks refer to.
+void BufferManager::write_marks(Buffer *buf) {
+  write_marks(buf->name, buf->mark_positions());
+}
+
+void BufferManager::write_marks(const string &name,
+                                const map<string, size_t> &marks) {
+  string marks_file_path = temp_directory + name + ".marks";
+  if (marks.empty()) {
+    unlink(marks_file_path.c_str());
+    return;
+  }
+
+  ofstream marks_file(marks_file_path);
+  for (const auto &[mark, index] : marks)
+    marks_file << index << " " << mark << "\n";
+}
+
+map<string, size_t> BufferManager::read_marks(const string &name) {
+  map<string, size_t> marks;
+  ifstream marks_file(temp_directory + name + ".marks");
+  size_t mark_index;
+  string mark;
+  while (marks_file >> mark_index && getline(marks_file >> ws, mark))
+    marks[mark] = mark_index;
+  return marks;
+}
+
+// Writes a buffer's deferred edits to its temp copy now
+bool BufferManager::flush_buffer(Buffer *buf) {
+  if (!buf->dirty)
+    return true;
+
+  bool deferred = defer_persistence;
+  defer_persistence = false;
+  bool saved = save_buffer_to_temp(buf, buf->overwrite_pending);
+  defer_persistence = deferred;
+  return saved;
+}
+
+bool BufferManager::sync_buffers() {
+  vector<Buffer *> dirty_buffers;
+  buffers.for_each([&dirty_buffers](Buffer *buf) {
+    if (buf->dirty)
+      dirty_buffers.push_back(buf);
+  });
+
+  bool synced = true;
+  for (Buffer *buf : dirty_buffers)
+    synced = flush_buffer(buf) && synced;
+  return synced;
+}
+
+// Writes the path and version files next to a freshly written temp copy and
+// makes that copy the buffer's new merge base. Called with the lock held.
+void BufferManager::commit_persisted_metadata(Buffer *buf,
+                                              unsigned long version) {
+  string meta_file_path = temp_directory + buf->name + ".path";
+  ofstream meta_file(meta_file_path);
+  if (meta_file.is_open()) {
+    meta_file << buf->file_path;
+    meta_file.close();
+  }
+
+  buf->version = version;
+  ofstream version_file(temp_directory + buf->name + ".ver");
+  if (version_file.is_open()) {
+    version_file << buf->version;
+    version_file.close();
+  }
+
+  write_marks(buf);
+  buf->base_marks = buf->mark_positions();
+  write_stats(buf);
+  write_index_entries(buf);
+
+  if (buf->base_fd >= 0)
+    close(buf->base_fd);
+  buf->base_fd = open((temp_directory + buf->name + ".tmp").c_str(), O_RDONLY);
+}
+
+// Persists a change to the marks alone. It counts as a new version, so that
+// processes holding the previous one merge their marks with it instead of
+// overwriting it. Called with the lock held and the buffer current.
+void BufferManager::commit_marks(Buffer *buf) {
+  write_marks(buf);
+  buf->base_marks = buf->mark_positions();
+
+  // The lines did not change, so index entries of this version stay valid
+  fstream entries_file(temp_directory + buf->name + ".idx.data",
+                       ios::in | ios::out | ios::binary);
+  uint64_t entries_version;
+  if (entries_file.read(reinterpret_cast<char *>(&entries_version),
+                        sizeof(entries_version)) &&
+      entries_version == buf->version) {
+    entries_version = buf->version + 1;
+    entries_file.seekp(0);
+    entries_file.write(reinterpret_cast<const char *>(&entries_version),
+                       sizeof(entries_version));
+  }
+  entries_file.close();
+
+  buf->version++;
+  ofstream version_file(temp_directory + buf->name + ".ver");
+  if (version_file.is_open()) {
+    version_file << buf->version;
+    version_file.close();
+  }
+  write_stats(buf);
+}
+
+// Aggregates for stats, valid while the version matches
+void BufferManager::write_stats(Buffer *buf) {
+  ofstream stats_file(temp_directory + buf->name + ".stats");
+  if (stats_file.is_open()) {
+    stats_file << buf->version << "\n"
+               << buf->line_count() << " " << buf->byte_count() << "\n";
+    for (const auto &[length, count] : buf->length_counts())
+      stats_file << length << " " << count << "\n";
+    stats_file.close();
+  }
+}
+
+// Entries of the column index, in <name>.idx.data: the version of the lines
+// they were built from, the index definition and the entry count, followed
+// by (key hash, line) pairs. A process loading that same version takes them
+// over instead of hashing every line again.
+void BufferManager::write_index_entries(Buffer *buf) {
+  buf->resolve_index();
+  const ColumnIndex *index = buf->index();
+  if (!index || index->stale)
+    return;
+
+  vector<uint64_t> data = {buf->version, index->column,
+                           static_cast<uint64_t>(index->delimiter),
+                           index->lines.size()};
+  data.reserve(data.size() + 2 * index->lines.size());
+  for (const auto &[hash, entry] : index->lines) {
+    data.push_back(hash);
+    data.push_back(entry.line);
+  }
+
+  string entries_file_path = temp_directory + buf->name + ".idx.data";
+  string staged_file_path = entries_file_path + ".new";
+  ofstream entries_file(staged_file_path, ios::binary);
+  if (!entries_file.is_open())
+    return;
+  entries_file.write(reinterpret_cast<const char *>(data.data()),
+                     data.size() * sizeof(uint64_t));
+  entries_file.close();
+  if (entries_file.fail() ||
+      rename(staged_file_path.c_str(), entries_file_path.c_str()) != 0)
+    unlink(staged_file_path.c_str());
+}
+
+bool BufferManager::read_index_entries(Buffer *buf) {
+  const ColumnIndex *index = buf->index();
+  if (!index)
+    return false;
+
+  ifstream entries_file(temp_directory + buf->name + ".idx.data",
+                        ios::binary);
+  uint64_t header[4];
+  if (!entries_file.read(reinterpret_cast<char *>(header), sizeof(header)) ||
+      header[0] != buf->version || header[1] != index->column ||
+      header[2] != static_cast<uint64_t>(index->delimiter) ||
+      header[3] > buf->line_count())
+    return false;
+
+  vector<uint64_t> data(2 * header[3]);
+  if (!entries_file.read(reinterpret_cast<char *>(data.data()),
+                         data.size() * sizeof(uint64_t)))
+    return false;
+
+  unordered_multimap<size_t, ColumnIndex::Entry> lines;
+  lines.reserve(header[3]);
+  for (size_t i = 0; i < data.size(); i += 2) {
+    if (data[i + 1] >= buf->line_count())
+      return false;
+    lines.emplace(data[i], ColumnIndex::Entry{data[i + 1], 0});
+  }
+  buf->restore_index(std::move(lines));
+  return true;
+}
+
+void BufferManager::load_buffer_from_temp(string_view name_view) {
+  string name(name_view);
+  string temp_file_path = temp_directory + name + ".tmp";
+  if (!filesystem::exists(temp_file_path))
+    return;
+
+  int lock_fd = lock_buffer(name, LOCK_SH);
+
+  Buffer *buf = create_buffer(name);
+  buf->clear_lines();
+  buf->dirty = false;
+  buf->overwrite_pending = false;
+  buf->version = read_persisted_version(name);
+  if (buf->base_fd >= 0)
+    close(buf->base_fd);
+  buf->base_fd = open(temp_file_path.c_str(), O_RDONLY);
+
+  ifstream temp_file(temp_file_path);
+  if (temp_file.is_open()) {
+    string line;
+    while (getline(temp_file, line)) {
+      buf->append_line(line);
+    }
+    temp_file.close();
+  }
+
+  string meta_file_path = temp_directory + name + ".path";
+  if (filesystem::exists(meta_file_path)) {
+    ifstream meta_file(meta_file_path);
+    if (meta_file.is_open()) {
+      getline(meta_file, buf->file_path);
+      meta_file.close();
+    }
+  }
+
+  buf->base_marks = read_marks(name);
+  buf->clear_marks();
+  for (const auto &[mark, index] : buf->base_marks)
+    buf->set_mark(mark, index);
+
+  ifstream index_file(temp_directory + name + ".idx");
+  size_t index_column;
+  int index_delimiter;
+  if (index_file >> index_column >> index_delimiter) {
+    buf->create_index(index_column, static_cast<char>(index_delimiter));
+    read_index_entries(buf);
+  } else {
+    buf->drop_index();
+  }
+  buf->memory_footprint = buffer_footprint(buf);
+
+  if (lock_fd >= 0)
+    close(lock_fd);
+}
+
+void BufferManager::touch_buffer(Buffer *buf) {
+  buf->last_access = ++access_clock;
+  buf->epoch = command_epoch;
+}
+
+// Ends a command epoch: blocks of resident buffers that have not been touched
+// for compress_after_commands commands are packed with the LZ codec. Hot
+// blocks near recent edits stay unpacked.
+void BufferManager::compress_cold_blocks() {
+  if (compress_after_commands == 0)
+    return;
+
+  buffers.for_each([this](Buffer *buf) {
+    buf->epoch = command_epoch;
+    buf->compress_cold_blocks(compress_after_commands);
+    buf->memory_footprint = buffer_footprint(buf);
+  });
+  command_epoch++;
+}
+
+// Evicts least-recently-used buffers until the resident ones fit the budget.
+// Edits are persisted as they happen (deferred ones are flushed here first),
+// so an evicted buffer is simply dropped and get_buffer reloads it from its
+// temp copy on the next access.
+// Only called between commands, when no Buffer pointers are held.
+void BufferManager::enforce_memory_budget() {
+  if (memory_budget == 0)
+    return;
+
+  size_t resident = 0;
+  buffers.for_each(
+      [&resident](Buffer *buf) { resident += buf->memory_footprint; });
+
+  while (resident > memory_budget && buffers.size() > 1) {
+    Buffer *victim = nullptr;
+    buffers.for_each([this, &victim](Buffer *buf) {
+      if (buf != current_buffer && !undo_log.count(buf->name) &&
+          (!victim || buf->last_access < victim->last_access))
+        victim = buf;
+    });
+    if (!victim)
+      break;
+
+    flush_buffer(victim); // On a conflict the buffer is reloaded instead
+    resident -= victim->memory_footprint;
+    buffers.erase(victim->name);
+    buffer_pool.release(victim);
+    cache_evictions++;
+  }
+}
+
+void BufferManager::print_cache_stats() {
+  size_t resident = 0;
+  buffers.for_each(
+      [&resident](Buffer *buf) { resident += buf->memory_footprint; });
+
+  cout << "Resident buffers: " << buffers.size() << " (" << resident
+       << " bytes)" << endl;
+  cout << "Memory budget:    "
+       << (memory_budget ? to_string(memory_budget) + " bytes" : "unlimited")
+       << endl;
+  cout << "Cache hits:       " << cache_hits << endl;
+  cout << "Cache misses:     " << cache_misses << endl;
+  cout << "Evictions:        " << cache_evictions << endl;
+}
+
+bool BufferManager::open_file(string buffer_name, string file_path) {
+  Buffer *buf = create_buffer(buffer_name);
+
+  ifstream file(file_path);
+  if (!file.is_open())
+    return false;
+
+  buf->clear_lines();
+  buf->clear_marks();
+  buf->file_path = file_path;
+
+  string line;
+  while (getline(file, line))
+    buf->append_line(line);
+
+  file.close();
+  buf->is_modified = false;
+  return save_buffer_to_temp(buf, true);
+}
+
+bool BufferManager::save_file(string buffer_name, string file_path) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return false;
+
+  string save_path = file_path.empty() ? buf->file_path : file_path;
+  if (save_path.empty())
+    return false;
+
+  ofstream file(save_path);
+  if (!file.is_open())
+    return false;
+
+  for (size_t i = 0; i < buf->line_count(); i++)
+    file << buf->line(i) << "\n";
+
+  file.close();
+  buf->is_modified = false;
+  if (!file_path.empty())
+    buf->file_path = file_path;
+  return save_buffer_to_temp(buf);
+}
+
+bool BufferManager::create_new_buffer(string buffer_name, string file_path) {
+  Buffer *buf = create_buffer(buffer_name);
+  buf->clear_lines();
+  buf->clear_marks();
+  buf->file_path = file_path;
+  buf->is_modified = false;
+  return save_buffer_to_temp(buf, true);
+}
+
+// Creates buffer_name as a copy-on-write clone of source_name. In memory the
+// clone shares the source's line blocks; on disk its temp copy is a hard link
+// to the source's, which the next write of either buffer replaces by rename.
+bool BufferManager::clone_buffer(string buffer_name, string source_name) {
+  if (buffer_name == source_name)
+    return false;
+
+  string source_path = temp_directory + source_name + ".tmp";
+  if (!buffers.find(source_name) && !filesystem::exists(source_path)) {
+    cerr << "Buffer '" << source_name << "' not found." << endl;
+    return false;
+  }
+
+  Buffer *source = get_buffer(source_name);
+  Buffer *buf = create_buffer(buffer_name);
+  buf->share_lines(*source);
+  buf->file_path = "";
+  buf->is_modified = true;
+
+  // Lock in name order so concurrent clones in both directions cannot
+  // deadlock
+  bool source_first = source_name < buffer_name;
+  int first_lock = lock_buffer(source_first ? source_name : buffer_name,
+                               source_first ? LOCK_SH : LOCK_EX);
+  int second_lock = lock_buffer(source_first ? buffer_name : source_name,
+                                source_first ? LOCK_EX : LOCK_SH);
+
+  // The link is only valid if the source's temp copy is still the one its
+  // lines were loaded from
+  bool linked = false;
+  if (first_lock >= 0 && second_lock >= 0 && !source->dirty &&
+      !in_transaction &&
+      read_persisted_version(source_name) == source->version) {
+    string temp_file_path = temp_directory + buffer_name + ".tmp";
+    unlink(temp_file_path.c_str());
+    linked = link(source_path.c_str(), temp_file_path.c_str()) == 0;
+    if (linked)
+      commit_persisted_metadata(buf, read_persisted_version(buffer_name) + 1);
+  }
+
+  if (second_lock >= 0)
+    close(second_lock);
+  if (first_lock >= 0)
+    close(first_lock);
+
+  return linked || save_buffer_to_temp(buf, true);
+}
+
+// The target shares the sources' blocks; see Buffer::append_range
+bool BufferManager::concat_buffers(const vector<string> &source_names,
+                                   string target_name) {
+  vector<Buffer *> sources;
+  for (const string &source_name : source_names) {
+    if (source_name == target_name)
+      return false;
+    Buffer *source = get_buffer(source_name);
+    if (!source) {
+      cerr << "Buffer '" << source_name << "' not found." << endl;
+      return false;
+    }
+    sources.push_back(source);
+  }
+
+  Buffer *buf = create_buffer(target_name);
+  buf->clear_lines();
+  for (Buffer *source : sources)
+    if (source->line_count() > 0)
+      buf->append_range(*source, 0, source->line_count() - 1);
+  buf->file_path = "";
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf, true);
+}
+
+// Writes each part [part_starts[i], part_starts[i + 1]) of source to its own
+// buffer named <source>_<i + 1>. Returns the number of parts, or -1.
+int BufferManager::write_split_parts(Buffer *source,
+                                     const vector<size_t> &part_starts) {
+  // Parts left from an earlier split into more parts are removed, so the
+  // numbering always ends at the last part
+  vector<string> leftovers;
+  for (size_t i = part_starts.size() + 1;; i++) {
+    string part_name = source->name + "_" + to_string(i);
+    if (!buffers.find(part_name) &&
+        !filesystem::exists(temp_directory + part_name + ".tmp"))
+      break;
+    leftovers.push_back(part_name);
+  }
+  if (in_transaction && !leftovers.empty()) {
+    cerr << "Error: splitting would remove buffer '" << leftovers.front()
+         << "', which a transaction cannot undo." << endl;
+    return -1;
+  }
+
+  for (size_t i = 0; i < part_starts.size(); i++) {
+    size_t part_end = i + 1 < part_starts.size() ? part_starts[i + 1]
+                                                 : source->line_count();
+    Buffer *part = create_buffer(source->name + "_" + to_string(i + 1));
+    part->share_range(*source, part_starts[i], part_end - 1);
+    part->clear_marks();
+    part->file_path = "";
+    part->is_modified = true;
+    if (!save_buffer_to_temp(part, true))
+      return -1;
+  }
+
+  for (const string &part_name : leftovers)
+    remove_buffer(part_name);
+  return part_starts.size();
+}
+
+// Drops a buffer from memory and deletes its persisted copy
+void BufferManager::remove_buffer(const string &name) {
+  Buffer *buf = buffers.find(name);
+  if (buf) {
+    if (buf == current_buffer)
+      current_buffer = nullptr;
+    buffers.erase(name);
+    buffer_pool.release(buf);
+  }
+
+  int lock_fd = lock_buffer(name, LOCK_EX);
+  for (const char *suffix : {".tmp", ".path", ".ver", ".marks", ".stats",
+                             ".idx", ".idx.data"})
+    unlink((temp_directory + name + suffix).c_str());
+  if (lock_fd >= 0)
+    close(lock_fd);
+}
+
+int BufferManager::split_buffer_every(string buffer_name,
+                                      size_t lines_per_part) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || lines_per_part == 0)
+    return -1;
+
+  vector<size_t> part_starts;
+  for (size_t i = 0; i < buf->line_count(); i += lines_per_part)
+    part_starts.push_back(i);
+  return write_split_parts(buf, part_starts);
+}
+
+// Every line containing the pattern starts a new part. A pattern written as
+// /pattern/ has its slashes stripped.
+int BufferManager::split_buffer_at(string buffer_name, string pattern) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return -1;
+
+  if (pattern.size() >= 2 && pattern.front() == '/' && pattern.back() == '/')
+    pattern = pattern.substr(1, pattern.size() - 2);
+  if (pattern.empty()) {
+    cerr << "Error: split pattern cannot be empty." << endl;
+    return -1;
+  }
+
+  vector<size_t> part_starts;
+  for (size_t i = 0; i < buf->line_count(); i++)
+    if (i == 0 || buf->line(i).find(pattern) != string_view::npos)
+      part_starts.push_back(i);
+  return write_split_parts(buf, part_starts);
+}
+
+// Sorts line indices rather than the lines themselves; the buffer is rebuilt
+// once, in the sorted order
+bool BufferManager::sort_buffer(string buffer_name,
+                                const SortOptions &options) {
+  // Sorting in memory takes about as much again as the lines themselves, so
+  // a buffer that would not fit the budget twice over is sorted on disk
+  // (except in a transaction, which must not persist anything early)
+  if (memory_budget && !in_transaction) {
+    Buffer *resident = buffers.find(buffer_name);
+    if (resident && !flush_buffer(resident))
+      return false;
+
+    error_code size_error;
+    size_t size = filesystem::file_size(
+        temp_directory + buffer_name + ".tmp", size_error);
+    if (!size_error && size > memory_budget / 2)
+      return external_sort_buffer(buffer_name, options);
+  }
+
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return false;
+
+  size_t count = buf->line_count();
+  buf->materialize();
+  vector<string_view> lines(count);
+  vector<string_view> keys(count);
+  vector<double> numbers(count);
+  for (size_t i = 0; i < count; i++) {
+    lines[i] = buf->line(i);
+    keys[i] = sort_key(lines[i], options);
+    if (options.numeric)
+      numbers[i] = sort_number(keys[i]);
+  }
+
+  vector<size_t> order(count);
+  for (size_t i = 0; i < count; i++)
+    order[i] = i;
+
+  auto less = [&](size_t a, size_t b) {
+    return sort_keys_less(keys[a], numbers[a], keys[b], numbers[b], options);
+  };
+  parallel_sort(order.data(), order.data() + count, less,
+                max(1u, thread::hardware_concurrency()));
+
+  vector<string_view> sorted(count);
+  for (size_t i = 0; i < count; i++)
+    sorted[i] = lines[order[i]];
+  buf->replace_lines(sorted, order);
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf);
+}
+
+// External merge sort of a buffer's temp copy, for buffers larger than the
+// memory budget. The copy is read in runs of a quarter of the budget, each
+// run is sorted in memory and written out next to it, and the runs are then
+// merged through a loser tree into the new temp copy. All file I/O goes
+// through large sequential buffers. The buffer is dropped from memory
+// afterwards and reloaded on its next access.
+bool BufferManager::external_sort_buffer(const string &name,
+                                         const SortOptions &options) {
+  constexpr size_t io_buffer_size = 1 << 20;
+  size_t run_bytes = max<size_t>(memory_budget / 4, io_buffer_size);
+
+  int lock_fd = lock_buffer(name, LOCK_EX);
+  if (lock_fd < 0)
+    return false;
+
+  string temp_file_path = temp_directory + name + ".tmp";
+  vector<char> input_buffer(io_buffer_size);
+  ifstream input;
+  input.rdbuf()->pubsetbuf(input_buffer.data(), input_buffer.size());
+  input.open(temp_file_path);
+  if (!input.is_open()) {
+    close(lock_fd);
+    return false;
+  }
+
+  // Marked lines are followed through the runs and the merge: run_marks
+  // maps (run, position in the sorted run) to the line's old index
+  map<size_t, vector<string>> marked_lines;
+  for (const auto &[mark, index] : read_marks(name))
+    marked_lines[index].push_back(mark);
+  map<pair<size_t, size_t>, size_t> run_marks;
+  size_t run_base = 0;
+
+  // Phase 1: sorted runs
+  vector<string> run_paths;
+  bool ok = true;
+  string text;
+  vector<size_t> starts;
+  string line;
+  while (ok && input.peek() != EOF) {
+    text.clear();
+    starts.clear();
+    while (text.size() < run_bytes && getline(input, line)) {
+      starts.push_back(text.size());
+      text += line;
+      text += '\n';
+    }
+
+    size_t count = starts.size();
+    vector<string_view> lines(count);
+    vector<string_view> keys(count);
+    vector<double> numbers(count);
+    vector<size_t> order(count);
+    for (size_t i = 0; i < count; i++) {
+      size_t end = i + 1 < count ? starts[i + 1] : text.size();
+      lines[i] = string_view(text).substr(starts[i], end - starts[i]);
+      keys[i] = sort_key(lines[i].substr(0, lines[i].size() - 1), options);
+      if (options.numeric)
+        numbers[i] = sort_number(keys[i]);
+      order[i] = i;
+    }
+    parallel_sort(
+        order.data(), order.data() + count,
+        [&](size_t a, size_t b) {
+          return sort_keys_less(keys[a], numbers[a], keys[b], numbers[b],
+                                options);
+        },
+        max(1u, thread::hardware_concurrency()));
+    for (size_t i = 0; i < count && !marked_lines.empty(); i++)
+      if (marked_lines.count(run_base + order[i]))
+        run_marks[{run_paths.size(), i}] = run_base + order[i];
+    run_base += count;
+
+    run_paths.push_back(temp_file_path + ".run" + to_string(run_paths.size()));
+    vector<char> output_buffer(io_buffer_size);
+    ofstream run;
+    run.rdbuf()->pubsetbuf(output_buffer.data(), output_buffer.size());
+    run.open(run_paths.back());
+    for (size_t i : order)
+      run << lines[i];
+    run.close();
+    ok = !run.fail();
+  }
+  input.close();
+  string().swap(text);
+
+  // Phase 2: k-way merge. Runs are in input order and ties go to the lower
+  // run, so the merge is stable like the in-memory sort.
+  struct RunReader {
+    vector<char> buffer;
+    ifstream stream;
+    string line;
+    string_view key;
+    double number;
+    bool done;
+    size_t emitted = 0;
+  };
+  vector<unique_ptr<RunReader>> runs;
+  auto advance = [&options](RunReader &run) {
+    run.done = !getline(run.stream, run.line);
+    if (!run.done) {
+      run.key = sort_key(run.line, options);
+      run.number = options.numeric ? sort_number(run.key) : 0;
+    }
+  };
+  for (const string &run_path : run_paths) {
+    auto run = make_unique<RunReader>();
+    run->buffer.resize(io_buffer_size);
+    run->stream.rdbuf()->pubsetbuf(run->buffer.data(), run->buffer.size());
+    run->stream.open(run_path);
+    advance(*run);
+    runs.push_back(std::move(run));
+  }
+
+  string staged_file_path = temp_file_path + ".new";
+  map<string, size_t> sorted_marks;
+  if (ok && !runs.empty()) {
+    auto run_less = [&runs, &options](size_t a, size_t b) {
+      const RunReader &run_a = *runs[a], &run_b = *runs[b];
+      if (run_a.done != run_b.done)
+        return run_b.done; // Exhausted runs lose every match
+      if (!run_a.done) {
+        if (sort_keys_less(run_a.key, run_a.number, run_b.key, run_b.number,
+                           options))
+          return true;
+        if (sort_keys_less(run_b.key, run_b.number, run_a.key, run_a.number,
+                           options))
+          return false;
+      }
+      return a < b;
+    };
+    LoserTree<decltype(run_less)> tree(runs.size(), run_less);
+
+    vector<char> output_buffer(io_buffer_size);
+    ofstream output;
+    output.rdbuf()->pubsetbuf(output_buffer.data(), output_buffer.size());
+    output.open(staged_file_path);
+    for (size_t line_num = 0; !runs[tree.winner()]->done; line_num++) {
+      RunReader &run = *runs[tree.winner()];
+      output << run.line << '\n';
+      if (!run_marks.empty()) {
+        auto marked = run_marks.find({tree.winner(), run.emitted});
+        if (marked != run_marks.end())
+          for (const string &mark : marked_lines[marked->second])
+            sorted_marks[mark] = line_num;
+      }
+      run.emitted++;
+      advance(run);
+      tree.replay();
+    }
+    output.close();
+    ok = !output.fail();
+  }
+  runs.clear();
+  for (const string &run_path : run_paths)
+    unlink(run_path.c_str());
+
+  if (ok && !run_paths.empty()) {
+    unsigned long version = read_persisted_version(name) + 1;
+    ok = rename(staged_file_path.c_str(), temp_file_path.c_str()) == 0;
+    ofstream version_file(temp_directory + name + ".ver");
+    if (ok && version_file.is_open())
+      version_file << version;
+    if (ok)
+      write_marks(name, sorted_marks);
+  }
+  close(lock_fd);
+
+  // The resident copy, if any, no longer matches the temp copy
+  Buffer *buf = buffers.find(name);
+  if (ok && buf) {
+    if (buf == current_buffer)
+      current_buffer = nullptr;
+    buffers.erase(buf->name);
+    buffer_pool.release(buf);
+  }
+  return ok;
+}
+
+// Drops lines equal to the line before them. Returns the number of lines
+// removed, or -1.
+int BufferManager::uniq_buffer(string buffer_name) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return -1;
+
+  buf->materialize();
+  vector<string_view> kept;
+  vector<size_t> origins;
+  for (size_t i = 0; i < buf->line_count(); i++) {
+    string_view line = buf->line(i);
+    if (kept.empty() || kept.back() != line) {
+      kept.push_back(line);
+      origins.push_back(i);
+    }
+  }
+
+  int removed = buf->line_count() - kept.size();
+  if (removed == 0)
+    return 0;
+
+  buf->replace_lines(kept, origins);
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf) ? removed : -1;
+}
+
+// Keeps (or drops) the lines matching term in a single pass, then rebuilds
+// and persists the buffer once. Returns the number of lines removed, or -1.
+int BufferManager::filter_buffer(string buffer_name, bool keep, string term,
+                                 bool use_regex) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return -1;
+  if (term.empty()) {
+    cerr << "Error: filter term cannot be empty." << endl;
+    return -1;
+  }
+
+  regex pattern;
+  if (use_regex) {
+    try {
+      pattern = regex(term);
+    } catch (const regex_error &e) {
+      cerr << "Error: invalid regex '" << term << "' (" << e.what() << ")"
+           << endl;
+      return -1;
+    }
+  }
+
+  buf->materialize();
+  vector<string_view> kept;
+  vector<size_t> origins;
+  for (size_t i = 0; i < buf->line_count(); i++) {
+    string_view line = buf->line(i);
+    bool matches = use_regex ? regex_search(line.begin(), line.end(), pattern)
+                             : find_term(line, term) != string_view::npos;
+    if (matches == keep) {
+      kept.push_back(line);
+      origins.push_back(i);
+    }
+  }
+
+  int removed = buf->line_count() - kept.size();
+  if (removed == 0)
+    return 0;
+
+  buf->replace_lines(kept, origins);
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf) ? removed : -1;
+}
+
+// Applies edits in one pass over the lines. The edits are sorted by line,
+// inserts before a replace or delete of the same line and otherwise in the
+// order given, and merged with the lines into the new sequence. Marks keep
+// to their lines; a mark on a deleted line moves to the line after it.
+bool BufferManager::apply_line_edits(Buffer *buf, vector<LineEdit> &edits) {
+  auto by_line = [](const LineEdit &a, const LineEdit &b) {
+    if (a.line != b.line)
+      return a.line < b.line;
+    return a.kind == LineEdit::INSERT_BEFORE &&
+           b.kind != LineEdit::INSERT_BEFORE;
+  };
+  if (!is_sorted(edits.begin(), edits.end(), by_line))
+    stable_sort(edits.begin(), edits.end(), by_line);
+
+  size_t count = buf->line_count();
+  for (size_t i = 0; i < edits.size(); i++) {
+    const LineEdit &edit = edits[i];
+    if (edit.kind == LineEdit::INSERT_BEFORE)
+      continue;
+    if (edit.line >= count) {
+      cerr << "Error: line " << edit.line + 1 << " is out of range." << endl;
+      return false;
+    }
+    if (i > 0 && edits[i - 1].line == edit.line &&
+        edits[i - 1].kind != LineEdit::INSERT_BEFORE) {
+      cerr << "Error: line " << edit.line + 1 << " is edited twice." << endl;
+      return false;
+    }
+  }
+  if (!edits.empty() && edits.back().line > count) {
+    cerr << "Error: line " << edits.back().line + 1 << " is out of range."
+         << endl;
+    return false;
+  }
+
+  vector<pair<size_t, string>> marks;
+  for (const auto &[mark, index] : buf->mark_positions())
+    marks.emplace_back(index, mark);
+  sort(marks.begin(), marks.end());
+
+  // Runs of lines without edits go through append_range, so blocks the
+  // edits do not touch are shared instead of copied
+  Buffer *rebuilt = buffer_pool.acquire(buf->name);
+  if (buf->intern_table().enabled)
+    rebuilt->enable_interning();
+  size_t run_start = 0;
+  size_t next_edit = 0;
+  size_t next_mark = 0;
+  for (size_t i = 0; i <= count; i++) {
+    if (i < count && (next_edit == edits.size() || edits[next_edit].line > i))
+      continue;
+
+    size_t run_offset = rebuilt->line_count();
+    for (; next_mark < marks.size() && marks[next_mark].first < i; next_mark++)
+      marks[next_mark].first = run_offset + marks[next_mark].first - run_start;
+    if (run_start < i)
+      rebuilt->append_range(*buf, run_start, i - 1);
+    run_start = i + 1;
+
+    for (; next_edit < edits.size() && edits[next_edit].line == i &&
+           edits[next_edit].kind == LineEdit::INSERT_BEFORE;
+         next_edit++)
+      rebuilt->append_line(edits[next_edit].text);
+    for (; next_mark < marks.size() && marks[next_mark].first == i;
+         next_mark++)
+      marks[next_mark].first = rebuilt->line_count();
+    if (i == count)
+      break;
+
+    if (next_edit < edits.size() && edits[next_edit].line == i) {
+      if (edits[next_edit].kind == LineEdit::REPLACE_LINE)
+        rebuilt->append_line(edits[next_edit].text);
+      next_edit++;
+    } else {
+      rebuilt->append_line(buf->line(i)); // Line with inserts only
+    }
+  }
+
+  buf->share_lines(*rebuilt);
+  buffer_pool.release(rebuilt);
+  size_t new_count = buf->line_count();
+  for (const auto &[index, mark] : marks) {
+    if (new_count == 0)
+      buf->remove_mark(mark);
+    else
+      buf->set_mark(mark, min(index, new_count - 1));
+  }
+  return true;
+}
+
+// Applies an edit script: one edit per line, "N replace TEXT", "N insert
+// TEXT" or "N delete", with N the line number before any of the edits.
+// Returns the number of edits applied, or -1 if none were.
+int BufferManager::apply_edit_script(string buffer_name, string script_path) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return -1;
+
+  ifstream script(script_path);
+  if (!script.is_open()) {
+    cerr << "Error: could not open edit script " << script_path << endl;
+    return -1;
+  }
+
+  vector<LineEdit> edits;
+  string input;
+  size_t script_line = 0;
+  while (getline(script, input)) {
+    script_line++;
+    if (input.empty() || input[0] == '#')
+      continue;
+
+    size_t number_end = min(input.find(' '), input.size());
+    size_t kind_end = min(input.find(' ', number_end + 1), input.size());
+    string number = input.substr(0, number_end);
+    string kind = number_end == input.size()
+                      ? ""
+                      : input.substr(number_end + 1, kind_end - number_end - 1);
+    LineEdit edit;
+    if (kind == "insert")
+      edit.kind = LineEdit::INSERT_BEFORE;
+    else if (kind == "replace")
+      edit.kind = LineEdit::REPLACE_LINE;
+    else if (kind == "delete")
+      edit.kind = LineEdit::DELETE_LINE;
+    else
+      number.clear(); // Reported below
+
+    if (number.empty() || !all_of(number.begin(), number.end(), ::isdigit) ||
+        stoul(number) == 0) {
+      cerr << "Error: " << script_path << ":" << script_line
+           << ": expected \"N replace|insert TEXT\" or \"N delete\"" << endl;
+      return -1;
+    }
+    edit.line = stoul(number) - 1;
+    if (edit.kind != LineEdit::DELETE_LINE && kind_end < input.size())
+      edit.text = input.substr(kind_end + 1);
+    edits.push_back(std::move(edit));
+  }
+
+  if (edits.empty())
+    return 0;
+  if (!apply_line_edits(buf, edits))
+    return -1;
+
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf) ? edits.size() : -1;
+}
+
+// Applies a unified diff. Like patch(1), each hunk is looked for at its
+// line number shifted by the previous hunk's offset, then at growing
+// distances from there, first with all of its context and then ignoring up
+// to max_fuzz context lines at either end. Lines are compared by hash
+// first. Hunks may not overlap, and either all of them apply, in a single
+// pass over the lines, or none does. Returns the number of hunks applied,
+// or -1.
+int BufferManager::patch_buffer(string buffer_name, string diff_path) {
+  static constexpr size_t max_fuzz = 2;
+
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return -1;
+  vector<DiffHunk> hunks;
+  if (!read_unified_diff(diff_path, hunks))
+    return -1;
+
+  // Hashes of the buffer's lines, computed as the search reaches them. Odd,
+  // so that 0 can mean not yet computed.
+  size_t count = buf->line_count();
+  vector<size_t> line_hashes(count);
+  auto line_hash = [&](size_t index) {
+    if (!line_hashes[index])
+      line_hashes[index] = hash<string_view>()(buf->line(index)) | 1;
+    return line_hashes[index];
+  };
+
+  vector<LineEdit> edits;
+  size_t first_free = 0; // First line the next hunk may start at
+  ptrdiff_t offset = 0;
+  for (size_t h = 0; h < hunks.size(); h++) {
+    const DiffHunk &hunk = hunks[h];
+    vector<string_view> old_lines;
+    vector<size_t> old_hashes;
+    for (const string &line : hunk.lines) {
+      if (line[0] == '+')
+        continue;
+      old_lines.push_back(string_view(line).substr(1));
+      old_hashes.push_back(hash<string_view>()(old_lines.back()) | 1);
+    }
+
+    auto matches_at = [&](size_t position, size_t first, size_t length) {
+      for (size_t i = 0; i < length; i++)
+        if (line_hash(position + i) != old_hashes[first + i] ||
+            buf->line(position + i) != old_lines[first + i])
+          return false;
+      return true;
+    };
+
+    bool found = false;
+    size_t position = 0;
+    size_t skip_front = 0;
+    size_t fuzz = 0;
+    for (; fuzz <= max_fuzz && !found; fuzz++) {
+      if (fuzz > 0 && fuzz > hunk.leading_context &&
+          fuzz > hunk.trailing_context)
+        break; // Nothing more to ignore
+      skip_front = min(fuzz, hunk.leading_context);
+      size_t skip_back = min(fuzz, hunk.trailing_context);
+      size_t length = old_lines.size() - skip_front - skip_back;
+      if (count < length || count - length < first_free)
+        continue;
+
+      ptrdiff_t lowest = first_free;
+      ptrdiff_t highest = count - length;
+      ptrdiff_t expected = clamp<ptrdiff_t>(
+          static_cast<ptrdiff_t>(hunk.old_start + skip_front) + offset,
+          lowest, highest);
+      ptrdiff_t farthest = max(expected - lowest, highest - expected);
+      for (ptrdiff_t distance = 0; distance <= farthest && !found;
+           distance++) {
+        if (expected - distance >= lowest &&
+            matches_at(expected - distance, skip_front, length)) {
+          position = expected - distance;
+          found = true;
+        } else if (distance > 0 && expected + distance <= highest &&
+                   matches_at(expected + distance, skip_front, length)) {
+          position = expected + distance;
+          found = true;
+        }
+      }
+      if (found)
+        first_free = position + length;
+    }
+    if (!found) {
+      cerr << "Error: hunk #" << h + 1 << " (line " << hunk.old_start + 1
+           << ") does not match buffer '" << buffer_name << "'" << endl;
+      return -1;
+    }
+    fuzz--;
+
+    ptrdiff_t hunk_start = static_cast<ptrdiff_t>(position) -
+                           static_cast<ptrdiff_t>(skip_front);
+    ptrdiff_t hunk_offset = hunk_start - static_cast<ptrdiff_t>(hunk.old_start);
+    if (hunk_offset != 0 || fuzz > 0) {
+      cout << "Hunk #" << h + 1 << " succeeded at " << hunk_start + 1;
+      if (fuzz > 0)
+        cout << " with fuzz " << fuzz;
+      if (hunk_offset != 0)
+        cout << " (offset " << hunk_offset << " lines)";
+      cout << "." << endl;
+    }
+    offset = hunk_offset;
+
+    size_t index = position;
+    for (size_t i = skip_front; i < hunk.lines.size(); i++) {
+      const string &line = hunk.lines[i];
+      if (line[0] == '+') {
+        edits.push_back({LineEdit::INSERT_BEFORE, index, line.substr(1)});
+      } else {
+        if (line[0] == '-')
+          edits.push_back({LineEdit::DELETE_LINE, index, ""});
+        index++;
+      }
+    }
+  }
+
+  if (!apply_line_edits(buf, edits))
+    return -1;
+
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf) ? hunks.size() : -1;
+}
+
+// Prints the selected fields of every line, or stores them as the lines of
+// target_name when one is given
+bool BufferManager::cut_buffer(string buffer_name, const CutOptions &options,
+                               string target_name) {
+  if (buffer_name == target_name)
+    return false;
+
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return false;
+
+  Buffer *target = nullptr;
+  if (!target_name.empty()) {
+    target = create_buffer(target_name);
+    target->clear_lines();
+  }
+
+  string out;
+  for (size_t i = 0; i < buf->line_count(); i++) {
+    size_t line_start = out.size();
+    cut_fields(buf->line(i), options, out);
+    if (target) {
+      target->append_line(string_view(out).substr(line_start));
+      out.clear();
+    } else {
+      out += '\n';
+      if (out.size() >= 1 << 20) {
+        cout << out;
+        out.clear();
+      }
+    }
+  }
+  if (!target) {
+    cout << out;
+    return true;
+  }
+
+  target->file_path = "";
+  target->is_modified = true;
+  return save_buffer_to_temp(target, true);
+}
+
+// The index definition is persisted in <name>.idx and picked up again when
+// the buffer is loaded; the index itself is built on the first lookup and
+// persisted with each save
+bool BufferManager::create_index(string buffer_name, size_t column,
+                                 char delimiter) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || column == 0)
+    return false;
+
+  ofstream index_file(temp_directory + buffer_name + ".idx");
+  if (!index_file.is_open())
+    return false;
+  index_file << column << " " << static_cast<int>(delimiter);
+  index_file.close();
+  unlink((temp_directory + buffer_name + ".idx.data").c_str());
+
+  buf->create_index(column, delimiter);
+  return true;
+}
+
+bool BufferManager::drop_index(string buffer_name) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || !buf->index())
+    return false;
+
+  buf->drop_index();
+  unlink((temp_directory + buffer_name + ".idx").c_str());
+  unlink((temp_directory + buffer_name + ".idx.data").c_str());
+  return true;
+}
+
+void BufferManager::lookup_in_buffer(string buffer_name, string key) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+    return;
+  }
+  if (!buf->index()) {
+    cerr << "Buffer '" << buffer_name
+         << "' has no index, use \"index create col N\"." << endl;
+    return;
+  }
+
+  bool rebuilt = buf->index()->stale;
+  for (size_t i : buf->lookup(key))
+    cout << padder(4, to_string(i + 1).length()) << i + 1 << ": "
+         << buf->line(i) << endl;
+  buf->memory_footprint = buffer_footprint(buf);
+
+  // Spare the next process the rebuild, if these are the persisted lines
+  if (rebuilt && !buf->dirty && !in_transaction &&
+      read_persisted_version(buffer_name) == buf->version)
+    write_index_entries(buf);
+}
+
+void BufferManager::print_buffer(string buffer_name) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+    return;
+  }
+
+  for (size_t i = 0; i < buf->line_count(); i++)
+    cout << padder(4, to_string(i + 1).length()) << i + 1 << ": "
+         << buf->line(i) << endl;
+}
+
+bool BufferManager::append_to_buffer(string buffer_name, string content) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf)
+    return false;
+
+  buf->append_line(content);
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf);
+}
+
+void BufferManager::find_in_buffer(string buffer_name, string term) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
     return;
   }
 
-  for (size_t i = 0; i < buf->lines.size(); i++) {
-    if (buf->lines[i].find(term) != string::npos)
-      cout << padder(4, to_string(i + 1).length()) << i + 1 << ": "
-           << highlight_term(buf->lines[i], term) << endl;
+  for (size_t i = 0; i < buf->line_count(); i++) {
+    if (buf->line(i).find(term) != string::npos)
+      cout << padder(4, to_string(i + 1).length()) << i + 1 << ": "
+           << highlight_term(buf->line(i), term) << endl;
+  }
+}
+
+// Prints only the nth line containing term, scanning from from_line (0 for
+// the start of the scan direction) and stopping there. With wrap the scan
+// continues around the buffer end back to where it started. The hit becomes
+// the current line.
+bool BufferManager::find_next_in_buffer(string buffer_name, string term,
+                                        int from_line,
+                                        const FindOptions &options) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+    return false;
+  }
+
+  long count = buf->line_count();
+  long step = options.backward ? -1 : 1;
+  long index = from_line > 0 ? from_line - 1 : 0;
+  if (from_line <= 0 && options.backward)
+    index = count - 1;
+  if (term.empty() || options.nth == 0 || index >= count) {
+    cerr << "Error: invalid search" << endl;
+    return false;
+  }
+
+  size_t hits = 0;
+  for (long scanned = 0; scanned < count; scanned++, index += step) {
+    if (index < 0 || index >= count) {
+      if (!options.wrap)
+        break;
+      index = index < 0 ? count - 1 : 0;
+    }
+
+    string_view line = buf->line(index);
+    if (find_term(line, term) != string_view::npos && ++hits == options.nth) {
+      cout << padder(4, to_string(index + 1).length()) << index + 1 << ": "
+           << highlight_term(line, term) << endl;
+      set_current_line(buffer_name, index + 1);
+      return true;
+    }
   }
+
+  cerr << "No match for '" << term << "'" << endl;
+  return false;
 }
 
 void BufferManager::where_in_buffer(string buffer_name, string term) {
@@ -365,8 +4007,8 @@ void BufferManager::where_in_buffer(string buffer_name, string term) {
     return;
   }
 
-  for (size_t i = 0; i < buf->lines.size(); i++) {
-    if (buf->lines[i].find(term) != string::npos)
+  for (size_t i = 0; i < buf->line_count(); i++) {
+    if (buf->line(i).find(term) != string::npos)
       cout << i + 1 << endl;
   }
 }
@@ -385,8 +4027,8 @@ int BufferManager::replace_in_buffer(string buffer_name, string term,
 
   int total_replacement = 0;
 
-  for (size_t i = 0; i < buf->lines.size(); i++) {
-    string &line = buf->lines[i];
+  for (size_t i = 0; i < buf->line_count(); i++) {
+    string_view line = buf->line(i);
     string rebuilt;
     size_t pos = 0;
     size_t match;
@@ -403,17 +4045,18 @@ int BufferManager::replace_in_buffer(string buffer_name, string term,
       continue;
 
     rebuilt += line.substr(pos);
-    cout << padder(to_string(buf->lines.size()).length(),
+    cout << padder(to_string(buf->line_count()).length(),
                    to_string(i + 1).length())
          << i + 1 << ": " << highlight_term(rebuilt, replacement) << endl;
 
-    line = rebuilt;
+    buf->set_line(i, rebuilt);
     total_replacement += line_replacements;
   }
 
   if (total_replacement > 0) {
     buf->is_modified = true;
-    save_buffer_to_temp(buf);
+    if (!save_buffer_to_temp(buf))
+      return -1;
   }
 
   return total_replacement;
@@ -511,16 +4154,327 @@ void BufferManager::watch_buffer(string buffer_name) {
   signal(SIGINT, SIG_DFL);
 }
 
+// Answers from the maintained aggregates: a resident buffer's own, or the
+// ones persisted with its temp copy, so no lines are read or loaded
+void BufferManager::print_stats(string buffer_name) {
+  // The dedup ratio describes the resident lines, so with interning on the
+  // buffer is loaded rather than answered from the .stats file
+  if (!intern_lines && !buffers.find(buffer_name) &&
+      print_persisted_stats(buffer_name))
+    return;
+
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+    return;
+  }
+
+  cout << "Lines:       " << buf->line_count() << endl;
+  cout << "Bytes:       " << buf->byte_count() << endl;
+  cout << "Memory:      " << buf->storage_bytes() << endl;
+
+  const InternTable &interned = buf->intern_table();
+  if (!interned.enabled)
+    cout << "Dedup ratio: off (set BFF_INTERN=1)" << endl;
+  else
+    cout << "Dedup ratio: " << fixed << setprecision(2)
+         << interned.dedup_ratio() << "x (" << interned.distinct_lines()
+         << " distinct of " << interned.shared_lines() << " long lines)"
+         << endl;
+  print_length_histogram(buf->length_counts());
+}
+
+bool BufferManager::print_persisted_stats(const string &name) {
+  string stats_file_path = temp_directory + name + ".stats";
+  if (!filesystem::exists(stats_file_path))
+    return false;
+
+  int lock_fd = lock_buffer(name, LOCK_SH);
+  ifstream stats_file(stats_file_path);
+  unsigned long version;
+  size_t line_count, byte_count;
+  bool current = static_cast<bool>(stats_file >> version >> line_count >>
+                                   byte_count) &&
+                 version == read_persisted_version(name);
+
+  map<size_t, size_t> line_lengths;
+  size_t length, count;
+  while (current && stats_file >> length >> count)
+    line_lengths[length] = count;
+  if (lock_fd >= 0)
+    close(lock_fd);
+  if (!current)
+    return false;
+
+  cout << "Lines:       " << line_count << endl;
+  cout << "Bytes:       " << byte_count << endl;
+  cout << "Memory:      not loaded" << endl;
+  print_length_histogram(line_lengths);
+  return true;
+}
+
+// Counts words (runs of letters, digits and underscores). Each thread counts
+// a slice of the lines into its own map, and the maps are merged at the end.
+void BufferManager::print_word_stats(string buffer_name, size_t top_count) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+    return;
+  }
+
+  buf->materialize();
+  vector<string_view> lines(buf->line_count());
+  for (size_t i = 0; i < lines.size(); i++)
+    lines[i] = buf->line(i);
+
+  size_t thread_count = max(1u, thread::hardware_concurrency());
+  thread_count = min(thread_count, lines.size() / 4096 + 1);
+  vector<unordered_map<string_view, size_t>> counts(thread_count);
+  auto is_word_char = [](char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_';
+  };
+  auto count_slice = [&](size_t slice) {
+    unordered_map<string_view, size_t> &words = counts[slice];
+    size_t first = lines.size() * slice / thread_count;
+    size_t last = lines.size() * (slice + 1) / thread_count;
+    for (size_t i = first; i < last; i++) {
+      string_view line = lines[i];
+      for (size_t pos = 0; pos < line.size();) {
+        while (pos < line.size() && !is_word_char(line[pos]))
+          pos++;
+        size_t start = pos;
+        while (pos < line.size() && is_word_char(line[pos]))
+          pos++;
+        if (pos > start)
+          words[line.substr(start, pos - start)]++;
+      }
+    }
+  };
+
+  vector<thread> workers;
+  for (size_t slice = 1; slice < thread_count; slice++)
+    workers.emplace_back(count_slice, slice);
+  count_slice(0);
+  for (thread &worker : workers)
+    worker.join();
+
+  unordered_map<string_view, size_t> &total = counts[0];
+  for (size_t slice = 1; slice < thread_count; slice++)
+    for (const auto &[word, count] : counts[slice])
+      total[word] += count;
+
+  size_t word_count = 0;
+  vector<pair<string_view, size_t>> ranked(total.begin(), total.end());
+  for (const auto &entry : ranked)
+    word_count += entry.second;
+
+  top_count = min(top_count, ranked.size());
+  partial_sort(ranked.begin(), ranked.begin() + top_count, ranked.end(),
+               [](const auto &a, const auto &b) {
+                 return a.second != b.second ? a.second > b.second
+                                             : a.first < b.first;
+               });
+
+  cout << "Words:       " << word_count << " (" << ranked.size()
+       << " distinct)" << endl;
+  for (size_t i = 0; i < top_count; i++)
+    cout << padder(10, to_string(ranked[i].second).length(), ' ')
+         << ranked[i].second << " " << ranked[i].first << endl;
+}
+
+// Resolves a byte offset (from 0, counting newlines) to its line. "get"
+// prints the line, "print" the numbered line and "line" its number and the
+// offset's column within it.
+bool BufferManager::print_at_byte(string buffer_name, size_t offset,
+                                  string mode) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || offset >= buf->byte_count())
+    return false;
+
+  size_t column;
+  size_t index = buf->line_at_offset(offset, column);
+  if (mode == "get")
+    cout << buf->line(index) << endl;
+  else if (mode == "print")
+    cout << padder(4, to_string(index + 1).length()) << index + 1 << ": "
+         << buf->line(index) << endl;
+  else
+    cout << "Line " << index + 1 << ", column " << column + 1 << endl;
+  return true;
+}
+
+// Persists a change to the marks alone. The marks file is only rewritten
+// under the exclusive lock and if no other process has committed since the
+// buffer was loaded; otherwise the buffer is reloaded and the change
+// dropped, or with quiet, only left unwritten. Marks of buffers with
+// deferred edits are written with the edits.
+bool BufferManager::persist_marks(Buffer *buf) {
+  if (buf->dirty || in_transaction)
+    return true;
+
+  int lock_fd = lock_buffer(buf->name, LOCK_EX);
+  if (lock_fd < 0) {
+    cerr << "Error: could not lock buffer '" << buf->name << "' ("
+         << strerror(errno) << ")" << endl;
+    return false;
+  }
+  bool current = read_persisted_version(buf->name) == buf->version;
+  if (current && buf->mark_positions() != buf->base_marks)
+    commit_marks(buf);
+  close(lock_fd);
+
+  if (!current) {
+    cerr << "Error: buffer '" << buf->name
+         << "' was changed by another process, marks not updated." << endl;
+    load_buffer_from_temp(buf->name);
+  }
+  return current;
+}
+
+bool BufferManager::set_mark(string buffer_name, string mark, int line_num) {
+  // "." is the current line, and addresses end a mark name at an operator
+  if (mark == "." || mark.find_first_of("+-/?") != string::npos) {
+    cerr << "Error: invalid mark name '" << mark
+         << "', names cannot be '.' or contain '+', '-', '/' or '?'" << endl;
+    return false;
+  }
+
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || mark.empty() || line_num < 1 ||
+      line_num > static_cast<int>(buf->line_count()))
+    return false;
+
+  buf->set_mark(mark, line_num - 1);
+  return persist_marks(buf);
+}
+
+bool BufferManager::delete_mark(string buffer_name, string mark) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || !buf->remove_mark(mark))
+    return false;
+
+  return persist_marks(buf);
+}
+
+void BufferManager::list_marks(string buffer_name) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found or empty." << endl;
+    return;
+  }
+
+  for (const auto &[mark, index] : buf->mark_positions())
+    if (mark != ".")
+      cout << "@" << mark << ": " << index + 1 << endl;
+}
+
+// Resolves an ed-style line address to a 1-based line number. Terms apply
+// left to right, each relative to the line before it ("." at the start):
+//   N  $  .  @mark  line N, the last line, the current line, a mark
+//   +N  -N          an offset (N defaults to 1)
+//   /pat/  ?pat?    the next (previous) line containing pat, wrapping
+//                   around the buffer and stopping at the first hit
+// e.g. "$-2", ".+5", "100/error/", "@top?BEGIN?+1".
+bool BufferManager::resolve_address(string buffer_name, const string &address,
+                                    int &line_num) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf) {
+    cerr << "Buffer '" << buffer_name << "' not found." << endl;
+    return false;
+  }
+
+  const map<string, size_t> &marks = buf->mark_positions();
+  long count = buf->line_count();
+  auto dot = marks.find(".");
+  long line = dot != marks.end() ? dot->second + 1 : count;
+
+  size_t pos = 0;
+  while (pos < address.size()) {
+    char c = address[pos];
+    if (isdigit(static_cast<unsigned char>(c)) && pos == 0) {
+      size_t digits;
+      line = stol(address, &digits);
+      pos += digits;
+    } else if (c == '$' || c == '.') {
+      line = c == '$' ? count : line;
+      pos++;
+    } else if (c == '@') {
+      size_t end = min(address.find_first_of("+-/?", pos), address.size());
+      auto mark = marks.find(address.substr(pos + 1, end - pos - 1));
+      if (mark == marks.end()) {
+        cerr << "Error: no mark '" << address.substr(pos + 1, end - pos - 1)
+             << "' in buffer '" << buffer_name << "'" << endl;
+        return false;
+      }
+      line = mark->second + 1;
+      pos = end;
+    } else if (c == '+' || c == '-') {
+      size_t end = address.find_first_not_of("0123456789", pos + 1);
+      end = min(end, address.size());
+      long offset = end > pos + 1 ? stol(address.substr(pos + 1)) : 1;
+      line += c == '+' ? offset : -offset;
+      pos = end;
+    } else if (c == '/' || c == '?') {
+      size_t end = address.find(c, pos + 1);
+      string term = address.substr(pos + 1, end - pos - 1);
+      if (end == string::npos || term.empty()) {
+        cerr << "Error: invalid pattern in address '" << address << "'"
+             << endl;
+        return false;
+      }
+
+      long step = c == '/' ? 1 : -1;
+      long found = 0;
+      for (long k = 1; k <= count && !found; k++) {
+        long index = ((line - 1 + step * k) % count + count) % count;
+        if (find_term(buf->line(index), term) != string_view::npos)
+          found = index + 1;
+      }
+      if (!found) {
+        cerr << "Error: no line matches '" << term << "'" << endl;
+        return false;
+      }
+      line = found;
+      pos = end + 1;
+    } else {
+      cerr << "Error: invalid line address '" << address << "'" << endl;
+      return false;
+    }
+  }
+
+  if (line < 1) {
+    cerr << "Error: address '" << address << "' is before line 1" << endl;
+    return false;
+  }
+  line_num = line;
+  return true;
+}
+
+// Records the line a command addressed as the current line (".")
+// Read-only commands move "." in memory only, so readers never take the
+// exclusive lock; a shell session writes it along with its next edit
+void BufferManager::set_current_line(string buffer_name, int line_num) {
+  if (Buffer *buf = buffers.find(buffer_name))
+    set_current_line(buf, line_num);
+}
+
+// Edits move "." before saving, so it is persisted with their content
+void BufferManager::set_current_line(Buffer *buf, int line_num) {
+  if (buf->line_count() > 0)
+    buf->set_mark(".", min<size_t>(max(line_num, 1), buf->line_count()) - 1);
+}
+
 bool BufferManager::replace_line(string buffer_name, int line_num,
                                  string content) {
   Buffer *buf = get_buffer(buffer_name);
-  if (!buf || line_num < 1 || line_num > buf->lines.size())
+  if (!buf || line_num < 1 || line_num > buf->line_count())
     return false;
 
-  buf->lines[line_num - 1] = content; // line num - 1 due to zero-based indexing
+  // line num - 1 due to zero-based indexing
+  buf->set_line(line_num - 1, content);
   buf->is_modified = true;
-  save_buffer_to_temp(buf);
-  return true;
+  set_current_line(buf, line_num);
+  return save_buffer_to_temp(buf);
 }
 
 bool BufferManager::insert_line(string buffer_name, int line_num,
@@ -529,77 +4483,103 @@ bool BufferManager::insert_line(string buffer_name, int line_num,
   if (!buf || line_num < 1)
     return false;
 
-  if (line_num > buf->lines.size()) {
-    buf->lines.push_back(content);
+  if (line_num > buf->line_count()) {
+    buf->append_line(content);
   } else {
-    buf->lines.insert(buf->lines.begin() + line_num - 1, content);
+    buf->insert_line(line_num - 1, content);
   }
 
   buf->is_modified = true;
-  save_buffer_to_temp(buf);
-  return true;
+  set_current_line(buf, line_num);
+  return save_buffer_to_temp(buf);
 }
 
 bool BufferManager::delete_line(string buffer_name, int line_num) {
   Buffer *buf = get_buffer(buffer_name);
-  if (!buf || line_num < 1 || line_num > buf->lines.size())
+  if (!buf || line_num < 1 || line_num > buf->line_count())
     return false;
 
-  buf->lines.erase(buf->lines.begin() + line_num - 1);
+  buf->erase_line(line_num - 1);
   buf->is_modified = true;
-  save_buffer_to_temp(buf);
-  return true;
+  set_current_line(buf, line_num);
+  return save_buffer_to_temp(buf);
 }
 
 bool BufferManager::move_line(string buffer_name, int from_line, int to_line) {
   Buffer *buf = get_buffer(buffer_name);
-  if (!buf || from_line < 1 || to_line < 1 || from_line > buf->lines.size() ||
-      to_line > buf->lines.size())
+  if (!buf || from_line < 1 || to_line < 1 || from_line > buf->line_count() ||
+      to_line > buf->line_count())
     return false;
 
-  string line_content = buf->lines[from_line - 1];
-  buf->lines.erase(buf->lines.begin() + from_line - 1);
+  set_current_line(buf, to_line);
   if (to_line > from_line)
     to_line--;
 
-  buf->lines.insert(buf->lines.begin() + to_line - 1, line_content);
+  buf->move_line(from_line - 1, to_line - 1);
   buf->is_modified = true;
-  save_buffer_to_temp(buf);
-  return true;
+  return save_buffer_to_temp(buf);
 }
 
 bool BufferManager::copy_line(string buffer_name, int from_line, int to_line) {
   Buffer *buf = get_buffer(buffer_name);
   if (!buf || from_line < 1 || to_line < 1 ||
-      from_line > static_cast<int>(buf->lines.size()) ||
-      to_line > static_cast<int>(buf->lines.size()))
+      from_line > static_cast<int>(buf->line_count()) ||
+      to_line > static_cast<int>(buf->line_count()))
     return false;
 
-  string line_content = buf->lines[from_line - 1];
-  buf->lines.insert(buf->lines.begin() + to_line - 1, line_content);
+  buf->insert_line(to_line - 1, buf->line(from_line - 1));
   buf->is_modified = true;
-  save_buffer_to_temp(buf);
-  return true;
+  set_current_line(buf, to_line);
+  return save_buffer_to_temp(buf);
+}
+
+// The target shares the source's blocks within the range and copies lines
+// only at the range's ends; the rest is materialized when it is edited
+bool BufferManager::extract_lines(string buffer_name, int start_line,
+                                  int end_line, string target_name) {
+  if (buffer_name == target_name)
+    return false;
+
+  Buffer *source = get_buffer(buffer_name);
+  if (!source || start_line < 1 || end_line < start_line ||
+      end_line > static_cast<int>(source->line_count()))
+    return false;
+
+  Buffer *buf = create_buffer(target_name);
+  buf->share_range(*source, start_line - 1, end_line - 1);
+  buf->file_path = "";
+  buf->is_modified = true;
+  return save_buffer_to_temp(buf, true);
 }
 
 string BufferManager::get_line(string buffer_name, int line_num) {
   Buffer *buf = get_buffer(buffer_name);
-  if (!buf || line_num < 1 || line_num > static_cast<int>(buf->lines.size()))
+  if (!buf || line_num < 1 || line_num > static_cast<int>(buf->line_count()))
     return "";
 
-  return buf->lines[line_num - 1];
+  return string(buf->line(line_num - 1));
 }
 
 void BufferManager::print_line(string buffer_name, int line_num) {
   Buffer *buf = get_buffer(buffer_name);
-  if (!buf || line_num < 1 || line_num > static_cast<int>(buf->lines.size())) {
+  if (!buf || line_num < 1 || line_num > static_cast<int>(buf->line_count())) {
     cerr << "Line " << line_num << " not found in buffer '" << buffer_name
          << "'" << endl;
     return;
   }
 
   cout << padder(4, to_string(line_num).length()) << line_num << ": "
-       << buf->lines[line_num - 1] << endl;
+       << buf->line(line_num - 1) << endl;
+}
+
+// Prints the byte offset (from 0) at which the line starts
+bool BufferManager::print_line_offset(string buffer_name, int line_num) {
+  Buffer *buf = get_buffer(buffer_name);
+  if (!buf || line_num < 1 || line_num > static_cast<int>(buf->line_count()))
+    return false;
+
+  cout << buf->line_offset(line_num - 1) << endl;
+  return true;
 }
 
 void BufferManager::print_lines(string buffer_name, int start_line,
@@ -612,11 +4592,11 @@ void BufferManager::print_lines(string buffer_name, int start_line,
 
   if (start_line < 1)
     start_line = 1;
-  if (end_line > static_cast<int>(buf->lines.size()))
-    end_line = static_cast<int>(buf->lines.size());
+  if (end_line > static_cast<int>(buf->line_count()))
+    end_line = static_cast<int>(buf->line_count());
 
   for (int i = start_line; i <= end_line; ++i)
-    cout << padder(4, to_string(i).length()) << i << ": " << buf->lines[i - 1]
+    cout << padder(4, to_string(i).length()) << i << ": " << buf->line(i - 1)
          << endl;
 }
 
@@ -664,6 +4644,35 @@ ParsedCommand CommandParser::parse(int argc, char **argv) {
       cmd.buffer_cmd = NEW;
       if (argc > 4)
         cmd.buffer_arg = string(argv[4]);
+    } else if (command == "find" && argc > 5 &&
+               (string(argv[4]) == "--from" || string(argv[4]) == "--nth" ||
+                string(argv[4]) == "--backward" ||
+                string(argv[4]) == "--wrap") &&
+               !(argc == 7 && string(argv[5]) == "replace")) {
+      // Targeted search: find [--from ADDR] [--backward] [--wrap]
+      // [--nth K] <term>. Other terms, even ones starting with "--", and
+      // "find TERM replace WITH" keep their plain meaning
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = FIND_NEXT;
+      int arg = 4;
+      for (; arg + 1 < argc; arg++) {
+        string option = string(argv[arg]);
+        if (option == "--from" && arg + 2 < argc)
+          parse_line_address(string(argv[++arg]), cmd.line_number,
+                             cmd.line_address);
+        else if (option == "--backward")
+          cmd.find_options.backward = true;
+        else if (option == "--wrap")
+          cmd.find_options.wrap = true;
+        else if (option == "--nth" && arg + 2 < argc)
+          cmd.find_options.nth = stoul(string(argv[++arg]));
+        else
+          break;
+      }
+      if (arg + 1 != argc)
+        throw invalid_argument("Usage: find [--from N] [--backward] [--wrap] "
+                               "[--nth K] <term>");
+      cmd.buffer_arg = string(argv[arg]);
     } else if (command == "find" && argc > 4) {
       cmd.type = BUFFER_CMD;
       cmd.buffer_arg = string(argv[4]);
@@ -680,13 +4689,149 @@ ParsedCommand CommandParser::parse(int argc, char **argv) {
     } else if (command == "watch") {
       cmd.type = BUFFER_CMD;
       cmd.buffer_cmd = WATCH;
+    } else if (command == "shell") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = SHELL;
+    } else if (command == "apply" && argc > 4) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = APPLY;
+      cmd.buffer_arg = string(argv[4]);
+    } else if (command == "patch" && argc > 4) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = PATCH;
+      cmd.buffer_arg = string(argv[4]);
+    } else if (command == "batch" && argc > 4) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = BATCH;
+      cmd.buffer_arg = string(argv[4]);
+    } else if (command == "cache") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = CACHE_STATS;
+    } else if (command == "stats") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = STATS;
+      if (argc > 4 && string(argv[4]) == "words") {
+        cmd.buffer_arg = "words";
+        cmd.column = 10;
+      } else if (argc > 5 && string(argv[4]) == "top") {
+        cmd.buffer_arg = "words";
+        cmd.column = stoul(string(argv[5]));
+      } else if (argc > 4)
+        throw invalid_argument("Unknown stats option: " + string(argv[4]));
+    } else if (command == "clone" && argc > 4) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = CLONE;
+      cmd.buffer_arg = string(argv[4]);
+    } else if (command == "concat" && argc > 5) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = CONCAT;
+      cmd.buffer_args.push_back(cmd.buffer_name);
+      int arg = 4;
+      for (; arg < argc && string(argv[arg]) != "into"; arg++)
+        cmd.buffer_args.push_back(string(argv[arg]));
+      if (arg + 1 >= argc)
+        throw invalid_argument("Missing target buffer for concat");
+      cmd.buffer_arg = string(argv[arg + 1]);
+    } else if (command == "split" && argc > 5 &&
+               (string(argv[4]) == "every" || string(argv[4]) == "at")) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = SPLIT;
+      cmd.buffer_arg = string(argv[4]);
+      cmd.replacement_arg = string(argv[5]);
+    } else if (command == "sort") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = SORT;
+      for (int arg = 4; arg < argc; arg++) {
+        string option = string(argv[arg]);
+        if (option == "-n")
+          cmd.sort_options.numeric = true;
+        else if (option == "-r")
+          cmd.sort_options.reverse = true;
+        else if (option == "-k" && arg + 1 < argc)
+          cmd.sort_options.key_field = stoul(string(argv[++arg]));
+        else if (option == "-t" && arg + 1 < argc && argv[arg + 1][0])
+          cmd.sort_options.delimiter = argv[++arg][0];
+        else
+          throw invalid_argument("Unknown sort option: " + option);
+      }
+    } else if (command == "uniq") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = UNIQ;
+    } else if (command == "filter" && argc > 5 &&
+               (string(argv[4]) == "keep" || string(argv[4]) == "drop")) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = FILTER;
+      cmd.buffer_arg = string(argv[4]);
+      cmd.use_regex = string(argv[5]) == "--regex" && argc > 6;
+      cmd.replacement_arg = string(argv[cmd.use_regex ? 6 : 5]);
+    } else if (command == "cut" || command == "field") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = CUT;
+      for (int arg = 4; arg < argc; arg++) {
+        string option = string(argv[arg]);
+        if (option == "-d" && arg + 1 < argc && argv[arg + 1][0])
+          cmd.cut_options.delimiter = argv[++arg][0];
+        else if (option == "-f" && arg + 1 < argc)
+          parse_field_list(string(argv[++arg]), cmd.cut_options);
+        else if (option == "into" && arg + 1 < argc)
+          cmd.buffer_arg = string(argv[++arg]);
+        else
+          throw invalid_argument("Unknown " + command + " option: " + option);
+      }
+      if (cmd.cut_options.fields.empty() && !cmd.cut_options.open_from)
+        throw invalid_argument("No fields selected, use -f LIST");
+    } else if (command == "index" && argc > 4 && string(argv[4]) == "drop") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = INDEX_DROP;
+    } else if (command == "index" && argc > 6 &&
+               string(argv[4]) == "create" && string(argv[5]) == "col") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = INDEX_CREATE;
+      cmd.column = stoul(string(argv[6]));
+      if (argc > 8 && string(argv[7]) == "-d" && argv[8][0])
+        cmd.cut_options.delimiter = argv[8][0];
+    } else if (command == "at-byte" && argc > 5) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = AT_BYTE;
+      cmd.column = stoull(string(argv[4]));
+      cmd.buffer_arg = string(argv[5]);
+      if (cmd.buffer_arg != "get" && cmd.buffer_arg != "print" &&
+          cmd.buffer_arg != "line")
+        throw invalid_argument("Unknown at-byte operation: " + cmd.buffer_arg);
+    } else if (command == "mark" && argc > 6 && string(argv[4]) == "set") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = MARK_SET;
+      cmd.buffer_arg = string(argv[5]);
+      parse_line_address(string(argv[6]), cmd.line_number, cmd.line_address);
+    } else if (command == "mark" && argc > 5 &&
+               string(argv[4]) == "delete") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = MARK_DELETE;
+      cmd.buffer_arg = string(argv[5]);
+    } else if (command == "mark" && argc > 4 && string(argv[4]) == "list") {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = MARK_LIST;
+    } else if (command == "lookup" && argc > 4) {
+      cmd.type = BUFFER_CMD;
+      cmd.buffer_cmd = LOOKUP;
+      cmd.buffer_arg = string(argv[4]);
     }
     // Checking if line command
     else if (command == "line" && argc > 5) {
       cmd.type = LINE_CMD;
-      cmd.line_number = stoi(string(argv[4]));
+      string first, second;
+      bool ranged = split_address_range(string(argv[4]), first, second);
+      parse_line_address(ranged ? first : string(argv[4]), cmd.line_number,
+                         cmd.line_address);
 
       string line_operation = string(argv[5]);
+      if (ranged) {
+        if (line_operation != "print")
+          throw invalid_argument("Address ranges only work with print");
+        line_operation = "range";
+        parse_line_address(second, cmd.second_line_number,
+                           cmd.second_address);
+      }
 
       if (line_operation == "replace" && argc > 6) {
         cmd.line_cmd = REPLACE;
@@ -698,18 +4843,31 @@ ParsedCommand CommandParser::parse(int argc, char **argv) {
         cmd.line_cmd = DELETE;
       else if (line_operation == "move" && argc > 6) {
         cmd.line_cmd = MOVE;
-        cmd.second_line_number = stoi(string(argv[6]));
+        parse_line_address(string(argv[6]), cmd.second_line_number,
+                           cmd.second_address);
       } else if (line_operation == "copy" && argc > 6) {
         cmd.line_cmd = COPY;
-        cmd.second_line_number = stoi(string(argv[6]));
+        parse_line_address(string(argv[6]), cmd.second_line_number,
+                           cmd.second_address);
       } else if (line_operation == "get")
         cmd.line_cmd = GET;
       else if (line_operation == "print")
         cmd.line_cmd = PRINT_LINE;
+      else if (line_operation == "range" && ranged)
+        cmd.line_cmd = PRINT_RANGE;
       else if (line_operation == "range" && argc > 6) {
         cmd.line_cmd = PRINT_RANGE;
-        cmd.second_line_number = stoi(string(argv[6]));
-      } else
+        parse_line_address(string(argv[6]), cmd.second_line_number,
+                           cmd.second_address);
+      } else if (line_operation == "extract" && argc > 8 &&
+                 string(argv[7]) == "into") {
+        cmd.line_cmd = EXTRACT;
+        parse_line_address(string(argv[6]), cmd.second_line_number,
+                           cmd.second_address);
+        cmd.line_content = string(argv[8]);
+      } else if (line_operation == "offset")
+        cmd.line_cmd = OFFSET;
+      else
         throw invalid_argument("Unknown line operation: " + line_operation);
     } else
       throw invalid_argument("Unknown command: " + command);
@@ -735,7 +4893,34 @@ void CommandParser::print_usage() {
   cout << "bff -b \"test\" print" << endl;
   cout << "bff -b \"test\" append \"new content\"" << endl;
   cout << "bff -b \"test\" save \"/new/path/file.txt\"" << endl;
-  cout << "bff -b \"test\" new \"/path/to/newfile.txt\"" << endl << endl;
+  cout << "bff -b \"test\" new \"/path/to/newfile.txt\"" << endl;
+  cout << "bff -b \"copy\" clone \"test\"" << endl;
+  cout << "bff -b \"a\" concat \"b\" \"c\" into \"d\"" << endl;
+  cout << "bff -b \"test\" split every 1000" << endl;
+  cout << "bff -b \"test\" split at \"/BEGIN/\"" << endl;
+  cout << "bff -b \"test\" sort -n -r -k 2 -t \",\"" << endl;
+  cout << "bff -b \"test\" uniq" << endl;
+  cout << "bff -b \"test\" filter drop \"DEBUG\"" << endl;
+  cout << "bff -b \"test\" filter keep --regex \"^[0-9]+,\"" << endl;
+  cout << "bff -b \"test\" apply \"/path/to/edits.txt\"" << endl;
+  cout << "bff -b \"test\" patch \"/path/to/changes.diff\"" << endl;
+  cout << "bff -b \"test\" cut -d \",\" -f 1,3-5" << endl;
+  cout << "bff -b \"test\" field -f 2 into \"column\"" << endl;
+  cout << "bff -b \"test\" index create col 3 -d \",\"" << endl;
+  cout << "bff -b \"test\" lookup \"key\"" << endl;
+  cout << "bff -b \"test\" index drop" << endl;
+  cout << "bff -b \"test\" at-byte 123456 get|print|line" << endl;
+  cout << "bff -b \"test\" find --from 100 --backward --wrap --nth 2 \"x\""
+       << endl;
+  cout << "bff -b \"test\" mark set \"start\" 1200" << endl;
+  cout << "bff -b \"test\" mark delete \"start\"" << endl;
+  cout << "bff -b \"test\" mark list" << endl;
+  cout << "bff -b \"test\" shell" << endl;
+  cout << "bff -b \"test\" batch \"/path/to/edits.txt\"" << endl;
+  cout << "bff -b \"test\" cache" << endl;
+  cout << "bff -b \"test\" stats" << endl;
+  cout << "bff -b \"test\" stats words" << endl;
+  cout << "bff -b \"test\" stats top 20" << endl << endl;
 
   cout << "Line commands:" << endl;
   cout << "bff -b \"test\" line 10 replace \"return 0;\"" << endl;
@@ -746,13 +4931,20 @@ void CommandParser::print_usage() {
   cout << "bff -b \"test\" line 6 get" << endl;
   cout << "bff -b \"test\" line 2 print" << endl;
   cout << "bff -b \"test\" line 1 range 10" << endl;
+  cout << "bff -b \"test\" line 20 extract 40 into \"part\"" << endl;
+  cout << "bff -b \"test\" line 5 offset" << endl;
+  cout << "bff -b \"test\" line @start print" << endl;
+  cout << "bff -b \"test\" line \"$-2\" print" << endl;
+  cout << "bff -b \"test\" line \".+5\" delete" << endl;
+  cout << "bff -b \"test\" line \"100/error/\" print" << endl;
+  cout << "bff -b \"test\" line \"/BEGIN/,/END/\" print" << endl;
 }
 
 // TODO: Expand this?
 bool CommandParser::validate_command(const ParsedCommand &cmd) {
   if (cmd.buffer_name.empty())
     return false;
-  if (cmd.type == LINE_CMD && cmd.line_number <= 0)
+  if (cmd.type == LINE_CMD && cmd.line_number <= 0 && cmd.line_address.empty())
     return false;
   return true;
 }
@@ -769,7 +4961,24 @@ BFFEditor::~BFFEditor() {
   delete parser;
 }
 
-int BFFEditor::execute_command(const ParsedCommand &cmd) {
+// Turns the symbolic line addresses of a command into line numbers
+bool BFFEditor::resolve_addresses(ParsedCommand &cmd) {
+  if (!cmd.line_address.empty() &&
+      !buffer_manager->resolve_address(cmd.buffer_name, cmd.line_address,
+                                       cmd.line_number))
+    return false;
+  if (!cmd.second_address.empty() &&
+      !buffer_manager->resolve_address(cmd.buffer_name, cmd.second_address,
+                                       cmd.second_line_number))
+    return false;
+  return true;
+}
+
+int BFFEditor::execute_command(const ParsedCommand &parsed) {
+  ParsedCommand cmd = parsed;
+  if (!resolve_addresses(cmd))
+    return 1;
+
   if (cmd.type == BUFFER_CMD) {
     switch (cmd.buffer_cmd) {
     case OPEN:
@@ -780,7 +4989,10 @@ int BFFEditor::execute_command(const ParsedCommand &cmd) {
       cout << "File opened in buffer '" << cmd.buffer_name << "'" << endl;
       break;
     case APPEND:
-      buffer_manager->append_to_buffer(cmd.buffer_name, cmd.buffer_arg);
+      if (!buffer_manager->append_to_buffer(cmd.buffer_name, cmd.buffer_arg)) {
+        cerr << "Error: Could not append to buffer " << cmd.buffer_name << endl;
+        return 1;
+      }
       cout << "Content appended to buffer '" << cmd.buffer_name << "'" << endl;
       break;
     case SAVE:
@@ -800,16 +5012,185 @@ int BFFEditor::execute_command(const ParsedCommand &cmd) {
     case FIND:
       buffer_manager->find_in_buffer(cmd.buffer_name, cmd.buffer_arg);
       break;
+    case FIND_NEXT:
+      if (!buffer_manager->find_next_in_buffer(cmd.buffer_name, cmd.buffer_arg,
+                                               cmd.line_number,
+                                               cmd.find_options))
+        return 1;
+      break;
     case WHERE:
       buffer_manager->where_in_buffer(cmd.buffer_name, cmd.buffer_arg);
       break;
     case FIND_REPLACE:
-      buffer_manager->replace_in_buffer(cmd.buffer_name, cmd.buffer_arg,
-                                        cmd.replacement_arg);
+      if (buffer_manager->replace_in_buffer(cmd.buffer_name, cmd.buffer_arg,
+                                            cmd.replacement_arg) < 0)
+        return 1;
       break;
     case WATCH:
       buffer_manager->watch_buffer(cmd.buffer_name);
       break;
+    case SHELL:
+      return run_shell(cmd.buffer_name);
+    case BATCH:
+      return run_batch(cmd.buffer_name, cmd.buffer_arg);
+    case CACHE_STATS:
+      buffer_manager->print_cache_stats();
+      break;
+    case STATS:
+      if (cmd.buffer_arg == "words")
+        buffer_manager->print_word_stats(cmd.buffer_name, cmd.column);
+      else
+        buffer_manager->print_stats(cmd.buffer_name);
+      break;
+    case CLONE:
+      if (!buffer_manager->clone_buffer(cmd.buffer_name, cmd.buffer_arg)) {
+        cerr << "Error: Could not clone buffer " << cmd.buffer_arg << endl;
+        return 1;
+      }
+      cout << "Buffer '" << cmd.buffer_name << "' cloned from '"
+           << cmd.buffer_arg << "'" << endl;
+      break;
+    case CONCAT:
+      if (!buffer_manager->concat_buffers(cmd.buffer_args, cmd.buffer_arg)) {
+        cerr << "Error: Could not concatenate into buffer " << cmd.buffer_arg
+             << endl;
+        return 1;
+      }
+      cout << cmd.buffer_args.size() << " buffers concatenated into '"
+           << cmd.buffer_arg << "'" << endl;
+      break;
+    case SPLIT: {
+      int parts;
+      if (cmd.buffer_arg == "every")
+        parts = buffer_manager->split_buffer_every(
+            cmd.buffer_name, stoul(cmd.replacement_arg));
+      else
+        parts = buffer_manager->split_buffer_at(cmd.buffer_name,
+                                                cmd.replacement_arg);
+      if (parts < 0) {
+        cerr << "Error: Could not split buffer " << cmd.buffer_name << endl;
+        return 1;
+      }
+      if (parts == 0) {
+        cout << "Buffer '" << cmd.buffer_name << "' is empty, no parts created"
+             << endl;
+        break;
+      }
+      cout << "Buffer '" << cmd.buffer_name << "' split into " << parts
+           << " buffers (" << cmd.buffer_name << "_1.." << cmd.buffer_name
+           << "_" << parts << ")" << endl;
+      break;
+    }
+    case SORT:
+      if (!buffer_manager->sort_buffer(cmd.buffer_name, cmd.sort_options)) {
+        cerr << "Error: Could not sort buffer " << cmd.buffer_name << endl;
+        return 1;
+      }
+      cout << "Buffer '" << cmd.buffer_name << "' sorted" << endl;
+      break;
+    case UNIQ: {
+      int removed = buffer_manager->uniq_buffer(cmd.buffer_name);
+      if (removed < 0) {
+        cerr << "Error: Could not deduplicate buffer " << cmd.buffer_name
+             << endl;
+        return 1;
+      }
+      cout << removed << " duplicate lines removed from buffer '"
+           << cmd.buffer_name << "'" << endl;
+      break;
+    }
+    case FILTER: {
+      int removed = buffer_manager->filter_buffer(
+          cmd.buffer_name, cmd.buffer_arg == "keep", cmd.replacement_arg,
+          cmd.use_regex);
+      if (removed < 0) {
+        cerr << "Error: Could not filter buffer " << cmd.buffer_name << endl;
+        return 1;
+      }
+      cout << removed << " lines removed from buffer '" << cmd.buffer_name
+           << "'" << endl;
+      break;
+    }
+    case CUT:
+      if (!buffer_manager->cut_buffer(cmd.buffer_name, cmd.cut_options,
+                                      cmd.buffer_arg)) {
+        cerr << "Error: Could not extract fields from buffer "
+             << cmd.buffer_name << endl;
+        return 1;
+      }
+      if (!cmd.buffer_arg.empty())
+        cout << "Fields extracted into buffer '" << cmd.buffer_arg << "'"
+             << endl;
+      break;
+    case INDEX_CREATE:
+      if (!buffer_manager->create_index(cmd.buffer_name, cmd.column,
+                                        cmd.cut_options.delimiter)) {
+        cerr << "Error: Could not create index on buffer " << cmd.buffer_name
+             << endl;
+        return 1;
+      }
+      cout << "Index on column " << cmd.column << " created for buffer '"
+           << cmd.buffer_name << "'" << endl;
+      break;
+    case INDEX_DROP:
+      if (!buffer_manager->drop_index(cmd.buffer_name)) {
+        cerr << "Error: Buffer " << cmd.buffer_name << " has no index" << endl;
+        return 1;
+      }
+      cout << "Index dropped from buffer '" << cmd.buffer_name << "'" << endl;
+      break;
+    case LOOKUP:
+      buffer_manager->lookup_in_buffer(cmd.buffer_name, cmd.buffer_arg);
+      break;
+    case APPLY: {
+      int applied =
+          buffer_manager->apply_edit_script(cmd.buffer_name, cmd.buffer_arg);
+      if (applied < 0) {
+        cerr << "Error: Could not apply edits to buffer " << cmd.buffer_name
+             << endl;
+        return 1;
+      }
+      cout << applied << " edits applied to buffer '" << cmd.buffer_name << "'"
+           << endl;
+      break;
+    }
+    case PATCH: {
+      int hunks = buffer_manager->patch_buffer(cmd.buffer_name, cmd.buffer_arg);
+      if (hunks < 0) {
+        cerr << "Error: Could not patch buffer " << cmd.buffer_name << endl;
+        return 1;
+      }
+      cout << hunks << " hunks applied to buffer '" << cmd.buffer_name << "'"
+           << endl;
+      break;
+    }
+    case MARK_SET:
+      if (!buffer_manager->set_mark(cmd.buffer_name, cmd.buffer_arg,
+                                    cmd.line_number)) {
+        cerr << "Error: Could not set mark " << cmd.buffer_arg << endl;
+        return 1;
+      }
+      cout << "Mark '" << cmd.buffer_arg << "' set at line " << cmd.line_number
+           << endl;
+      break;
+    case MARK_DELETE:
+      if (!buffer_manager->delete_mark(cmd.buffer_name, cmd.buffer_arg)) {
+        cerr << "Error: Could not delete mark " << cmd.buffer_arg << endl;
+        return 1;
+      }
+      cout << "Mark '" << cmd.buffer_arg << "' deleted" << endl;
+      break;
+    case MARK_LIST:
+      buffer_manager->list_marks(cmd.buffer_name);
+      break;
+    case AT_BYTE:
+      if (!buffer_manager->print_at_byte(cmd.buffer_name, cmd.column,
+                                         cmd.buffer_arg)) {
+        cerr << "Error: Byte offset " << cmd.column << " not found in buffer '"
+             << cmd.buffer_name << "'" << endl;
+        return 1;
+      }
+      break;
     default:
     case PRINT:
       buffer_manager->print_buffer(cmd.buffer_name);
@@ -872,8 +5253,171 @@ int BFFEditor::execute_command(const ParsedCommand &cmd) {
       buffer_manager->print_lines(cmd.buffer_name, cmd.line_number,
                                   cmd.second_line_number);
       break;
+    case EXTRACT:
+      if (!buffer_manager->extract_lines(cmd.buffer_name, cmd.line_number,
+                                         cmd.second_line_number,
+                                         cmd.line_content)) {
+        cerr << "Error: Could not extract lines" << endl;
+        return 1;
+      }
+      cout << "Lines " << cmd.line_number << "-" << cmd.second_line_number
+           << " extracted into buffer '" << cmd.line_content << "'" << endl;
+      break;
+    case OFFSET:
+      if (!buffer_manager->print_line_offset(cmd.buffer_name,
+                                             cmd.line_number)) {
+        cerr << "Line " << cmd.line_number << " not found in buffer '"
+             << cmd.buffer_name << "'" << endl;
+        return 1;
+      }
+      break;
+    }
+
+    // Edits have moved "." already, as part of their save
+    bool edited = cmd.line_cmd == REPLACE || cmd.line_cmd == INSERT ||
+                  cmd.line_cmd == DELETE || cmd.line_cmd == MOVE ||
+                  cmd.line_cmd == COPY;
+    bool to_second = cmd.line_cmd == PRINT_RANGE || cmd.line_cmd == EXTRACT;
+    if (!edited)
+      buffer_manager->set_current_line(cmd.buffer_name,
+                                       to_second ? cmd.second_line_number
+                                                 : cmd.line_number);
+  }
+
+  buffer_manager->compress_cold_blocks();
+  buffer_manager->enforce_memory_budget();
+  return 0;
+}
+
+// Runs one line of a shell session or batch file: a command in the usual
+// grammar without the "bff -b NAME" prefix, or "-b OTHER ..." to address
+// another buffer
+int BFFEditor::run_script_line(const string &buffer_name,
+                               vector<string> words) {
+  if (words[0] != "-b")
+    words.insert(words.begin(), {"-b", buffer_name});
+  words.insert(words.begin(), "bff");
+  vector<char *> args;
+  for (string &word : words)
+    args.push_back(word.data());
+  args.push_back(nullptr);
+
+  try {
+    ParsedCommand cmd = parser->parse(args.size() - 1, args.data());
+    if (cmd.type == BUFFER_CMD &&
+        (cmd.buffer_cmd == SHELL || cmd.buffer_cmd == BATCH))
+      throw invalid_argument("Already in a shell");
+    if (!parser->validate_command(cmd))
+      throw invalid_argument("Invalid command");
+    return execute_command(cmd);
+  } catch (const exception &e) {
+    cerr << "Error: " << e.what() << endl;
+    return 1;
+  }
+}
+
+// Reads script lines from stdin. Buffers stay resident between commands and
+// edits are only persisted on "sync", when a buffer is evicted, and on exit
+// ("quit", "exit" or end of input). "begin" ... "commit" groups commands
+// into a transaction that is persisted once, or undone by "abort".
+int BFFEditor::run_shell(const string &buffer_name) {
+  buffer_manager->set_deferred_persistence(true);
+  bool interactive = isatty(STDIN_FILENO);
+  int result = 0;
+
+  string input;
+  while (true) {
+    if (interactive)
+      cout << buffer_name << (buffer_manager->transaction_open() ? "* " : "> ")
+           << flush;
+    if (!getline(cin, input))
+      break;
+
+    vector<string> words = split_command_line(input);
+    if (words.empty())
+      continue;
+    if (words[0] == "quit" || words[0] == "exit")
+      break;
+    if (words[0] == "help") {
+      parser->print_usage();
+    } else if (words[0] == "sync") {
+      if (buffer_manager->transaction_open())
+        cerr << "Error: Commit or abort the transaction first" << endl;
+      else if (!buffer_manager->sync_buffers())
+        cerr << "Error: Could not sync every buffer" << endl;
+    } else if (words[0] == "begin") {
+      if (!buffer_manager->begin_transaction())
+        cerr << "Error: A transaction is already open" << endl;
+    } else if (words[0] == "commit") {
+      if (!buffer_manager->transaction_open())
+        cerr << "Error: No transaction is open" << endl;
+      else if (!buffer_manager->commit_transaction())
+        cerr << "Error: Transaction not committed, its edits were undone"
+             << endl;
+      else
+        cout << "Transaction committed" << endl;
+    } else if (words[0] == "abort") {
+      if (!buffer_manager->transaction_open()) {
+        cerr << "Error: No transaction is open" << endl;
+      } else {
+        buffer_manager->abort_transaction();
+        cout << "Transaction aborted" << endl;
+      }
+    } else {
+      result = run_script_line(buffer_name, words);
+    }
+  }
+
+  if (interactive)
+    cout << endl;
+  if (buffer_manager->transaction_open()) {
+    buffer_manager->abort_transaction();
+    cerr << "Open transaction aborted" << endl;
+  }
+  buffer_manager->set_deferred_persistence(false);
+  if (!buffer_manager->sync_buffers()) {
+    cerr << "Error: Could not persist every buffer" << endl;
+    return 1;
+  }
+  return result;
+}
+
+// Runs every line of a script file as one transaction: if any command
+// fails, none of the edits are kept
+int BFFEditor::run_batch(const string &buffer_name, const string &path) {
+  ifstream script(path);
+  if (!script.is_open()) {
+    cerr << "Error: Could not open batch file " << path << endl;
+    return 1;
+  }
+
+  buffer_manager->set_deferred_persistence(true);
+  buffer_manager->begin_transaction();
+  string input;
+  size_t line_num = 0;
+  size_t commands = 0;
+  while (getline(script, input)) {
+    line_num++;
+    vector<string> words = split_command_line(input);
+    if (words.empty() || words[0][0] == '#')
+      continue;
+    if (run_script_line(buffer_name, words) != 0) {
+      buffer_manager->abort_transaction();
+      buffer_manager->set_deferred_persistence(false);
+      cerr << "Error: Batch aborted at line " << line_num << ", no edits kept"
+           << endl;
+      return 1;
     }
+    commands++;
+  }
+
+  bool committed = buffer_manager->commit_transaction();
+  buffer_manager->set_deferred_persistence(false);
+  if (!committed) {
+    cerr << "Error: Batch not committed, no edits kept" << endl;
+    return 1;
   }
+  cout << "Batch of " << commands << " commands committed" << endl;
   return 0;
 }
 